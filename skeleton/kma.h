@@ -95,6 +95,16 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+/***********************************************************************
+ *  Title: Returns idle memory to the system
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases every free page the page layer still keeps
+ *             resident (see trim_pages() in kpage.h)
+ *    Input: none
+ *    Output: the number of pages released
+ ***********************************************************************/
+EXTERN int kma_trim(void);
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
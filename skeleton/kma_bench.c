@@ -0,0 +1,282 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Benchmark
+ * -------------------------------------------------------------------------
+ *    Purpose: Measures the latency of kma_free() for each power-of-two
+ *             buffer size (buddy order), or the mean and worst-case
+ *             latency of kma_malloc() and kma_free() over a trace, or
+ *             (KMA_SLAB) how object cache throughput scales with threads
+ *    File: kma_bench.c
+ ***************************************************************************/
+#define __KMA_TEST_IMPL__
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+#ifdef KMA_SLAB
+#include "kma_slab.h"
+#endif
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// buffers live at a time, and rounds per order
+#define NBUFS 512
+#define ROUNDS 20
+
+// per-buffer header of the allocator under test, so a request fills a
+// buffer of exactly the order measured; bud and p2fl have none
+#ifdef KMA_WBUD
+#define BENCH_HDR sizeof(int)
+#else
+#define BENCH_HDR 0
+#endif
+
+// scaling benchmark: object size, objects each thread holds at a time,
+// and alloc/free pairs per thread
+#define MTOBJSIZE 64
+#define MTBATCH 64
+#define MTOPS 10000000
+
+/************Global Variables*********************************************/
+
+static void* bufs[NBUFS];
+
+#ifdef KMA_SLAB
+static kma_cache_t* mtcache;
+static pthread_barrier_t mtbarrier;
+#endif
+
+/************Function Prototypes******************************************/
+
+// time freeing NBUFS buffers of the given size, in nanoseconds per free
+double bench_free(kma_size_t);
+
+// replay a trace file, timing every call
+void bench_trace(char*);
+
+#ifdef KMA_SLAB
+// time 1 to maxthreads threads sharing one object cache
+void bench_threads(int);
+void* bench_thread(void*);
+#endif
+
+// nanoseconds since start
+double elapsedNs(struct timespec*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  int order;
+
+  page_init();
+
+#ifdef KMA_SLAB
+  if (argc >= 2 && strcmp(argv[1], "-t") == 0)
+    {
+      bench_threads(argc == 3 ? atoi(argv[2])
+		    : sysconf(_SC_NPROCESSORS_ONLN));
+      return 0;
+    }
+#endif
+
+  if (argc == 2)
+    {
+      bench_trace(argv[1]);
+      return 0;
+    }
+
+  printf("order  bytes   ns/free\n");
+  // orders up to a full page
+  for (order = 4; (1 << order) <= PAGESIZE; order++)
+    {
+      printf("%5d  %5d  %8.1f\n", order, 1 << order,
+	     bench_free((1 << order) - BENCH_HDR));
+    }
+
+  return 0;
+}
+
+double
+bench_free(kma_size_t size)
+{
+  struct timespec start;
+  double ns = 0;
+  int round, i;
+
+  srand(1);
+  for (round = 0; round < ROUNDS; round++)
+    {
+      for (i = 0; i < NBUFS; i++)
+	{
+	  bufs[i] = kma_malloc(size);
+	  if (bufs[i] == NULL)
+	    error("kma_malloc failed", "");
+	}
+
+      // free in random order, so buddies come back at random times
+      for (i = NBUFS - 1; i > 0; i--)
+	{
+	  int j = rand() % (i + 1);
+	  void* tmp = bufs[i];
+	  bufs[i] = bufs[j];
+	  bufs[j] = tmp;
+	}
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (i = 0; i < NBUFS; i++)
+	{
+	  kma_free(bufs[i], size);
+	}
+      ns += elapsedNs(&start);
+    }
+
+  return ns / ((double)ROUNDS * NBUFS);
+}
+
+void
+bench_trace(char* file)
+{
+  FILE* f = fopen(file, "r");
+  char command[16];
+  int n_req, id, size;
+  void** ptrs;
+  int* sizes;
+  struct timespec start;
+  double ns;
+  double mallocNs = 0, mallocMax = 0, freeNs = 0, freeMax = 0;
+  int n_malloc = 0, n_free = 0;
+
+  if (f == NULL || fscanf(f, "%d\n", &n_req) != 1)
+    error("unable to read trace", file);
+
+  ptrs = calloc(n_req, sizeof(void*));
+  sizes = calloc(n_req, sizeof(int));
+
+  while (fscanf(f, "%10s", command) == 1)
+    {
+      if (strcmp(command, "REQUEST") == 0)
+	{
+	  if (fscanf(f, "%d %d", &id, &size) != 2)
+	    error("Not enough arguments to REQUEST", "");
+	  clock_gettime(CLOCK_MONOTONIC, &start);
+	  ptrs[id] = kma_malloc(size);
+	  ns = elapsedNs(&start);
+	  sizes[id] = size;
+	  mallocNs += ns;
+	  if (ns > mallocMax)
+	    mallocMax = ns;
+	  n_malloc++;
+	}
+      else
+	{
+	  if (fscanf(f, "%d", &id) != 1)
+	    error("Not enough arguments to FREE", "");
+	  clock_gettime(CLOCK_MONOTONIC, &start);
+	  kma_free(ptrs[id], sizes[id]);
+	  ns = elapsedNs(&start);
+	  freeNs += ns;
+	  if (ns > freeMax)
+	    freeMax = ns;
+	  n_free++;
+	}
+    }
+  fclose(f);
+
+  printf("kma_malloc: mean %8.0f ns, max %8.0f ns\n", mallocNs / n_malloc, mallocMax);
+  printf("kma_free:   mean %8.0f ns, max %8.0f ns\n", freeNs / n_free, freeMax);
+  free(ptrs);
+  free(sizes);
+}
+
+#ifdef KMA_SLAB
+void
+bench_threads(int maxthreads)
+{
+  pthread_t threads[maxthreads];
+  struct timespec start;
+  double ns, base = 0;
+  int n, i;
+
+  printf("threads  Mops/s  speedup\n");
+  for (n = 1; n <= maxthreads; n++)
+    {
+      mtcache = kma_cache_create(MTOBJSIZE, 0, NULL);
+      pthread_barrier_init(&mtbarrier, NULL, n + 1);
+      for (i = 0; i < n; i++)
+	{
+	  if (pthread_create(&threads[i], NULL, bench_thread, NULL) != 0)
+	    error("pthread_create failed", "");
+	}
+
+      pthread_barrier_wait(&mtbarrier);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (i = 0; i < n; i++)
+	{
+	  pthread_join(threads[i], NULL);
+	}
+      ns = elapsedNs(&start);
+      pthread_barrier_destroy(&mtbarrier);
+      kma_cache_destroy(mtcache);
+
+      // alloc/free pairs per microsecond
+      if (n == 1)
+	base = MTOPS / ns;
+      printf("%7d  %6.1f  %7.2f\n", n, (double)n * MTOPS / ns * 1e3,
+	     n * MTOPS / ns / base);
+    }
+}
+
+void*
+bench_thread(void* arg)
+{
+  void* objs[MTBATCH];
+  int done, i;
+
+  pthread_barrier_wait(&mtbarrier);
+  for (done = 0; done < MTOPS; done += MTBATCH)
+    {
+      for (i = 0; i < MTBATCH; i++)
+	{
+	  objs[i] = kma_cache_alloc(mtcache);
+	  *(int*)objs[i] = i;
+	}
+      for (i = 0; i < MTBATCH; i++)
+	{
+	  kma_cache_free(mtcache, objs[i]);
+	}
+    }
+  return NULL;
+}
+#endif
+
+double
+elapsedNs(struct timespec* start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
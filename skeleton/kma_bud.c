@@ -41,11 +41,16 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h> // for debug logging, remove in final hand-in version
 /************Private include**********************************************/
 #include "kpage.h"
 #include "kma.h"
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
  *  Global variables begin with g. Global constants with k. Local
@@ -53,28 +58,57 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// The heap is made of regions, runs of pages that are each one buddy
+// block of 2^k pages, carved down to buffers as small as 16 bytes.
+// Pages carry no header: each page's allocation bitmap (one bit per 16
+// byte granule, set while in use) and its region sit in a slot of a
+// separate metadata page, found through the page descriptor's priv
+// field; the free list heads are plain globals. A region whose buffers
+// all coalesce back is returned to kpage. Buffers have no header:
+// kma_free() gets the size back from its caller.
+
+// buffer sizes 16 B .. 4 MB; bigger requests get their own page run
+#define MINORDER 4
+#define MAXCLASSES 19
+#define MAXBLOCK (1 << (MINORDER + MAXCLASSES - 1))
+
+// a free buffer, linked both ways so a buddy can be unlinked in O(1)
+typedef struct block
+{
+  struct block* next;
+  struct block* prev;
+} block_t;
+
 typedef struct
 {
-  void* minaddr;
-  void* maxaddr;
-  int allocs;
-  int bufsizes[10];
-  void* lists[10];
+  int nclasses;
+  int bufsizes[MAXCLASSES];
+  block_t* lists[MAXCLASSES];
 } freelist_t;
 
+// metadata of one page, its bitmap sized for the page size in use
 typedef struct
 {
-  kpage_t* me;
-  void* nextpage;
-  char bitmap[128];
-} page_t;
+  void* region;            // first page of the page's region
+  int regionsize;
+  unsigned long bitmap[];
+} pagemeta_t;
+
+#define BITMAPSIZE (PAGESIZE / 16 / 8)
+#define SLOTSIZE (sizeof(pagemeta_t) + BITMAPSIZE)
 
-typedef enum
+// a metadata page is this header followed by SLOTSIZE slots
+typedef struct metapage
 {
-  NORMAL,
-  BIG,
-  HUGE
-} page_size_t;
+  struct metapage* next;  // metadata pages with free slots
+  struct metapage* prev;
+  int used;               // slots handed out
+  void* freeslots;
+} metapage_t;
+
+#define META(page) ((pagemeta_t*)kpage_of(page)->priv)
+
+#define WORDBITS (8 * sizeof(unsigned long))
 
 typedef enum 
 {
@@ -83,33 +117,55 @@ typedef enum
 } mem_status_t;
 
 /************Global Variables*********************************************/
-static kpage_t* pages = NULL;
+static freelist_t freelist;
+static bool initialized = FALSE;
+
+// metadata pages with free slots
+static metapage_t* metapages = NULL;
 /************Function Prototypes******************************************/
-// get the first page and add freelist struct
+// set the buffer sizes up
 void initializepages();
 
 // add a buffer to the free list
 void addtofreelist(void*, int); 
 
+// take a buffer off its free list
+void removefromfreelist(void*, int);
+
 // try to alloc by using the free list
 void* get_free_block(kma_size_t);
 
-// get another page and add buffers to the free lists
-void allocate_new_page();
+// get a region big enough for a buffer and add it to the free lists
+void allocate_new_region(int);
+
+// return a fully coalesced region to kpage
+void free_region(void*);
 
-// free all the kpages we've gotten
-void freekpages();
+// get and release a page metadata slot
+pagemeta_t* get_meta();
+void put_meta(pagemeta_t*);
 
 // update the bitmap representing used/free memory regions
 void update_bitmap(void*,kma_size_t,mem_status_t);
 
-// coalesce adjacent memory regions, if possible
-int coalesce_blocks(void*,int);
+// coalesce a free buffer with its buddies, as far as they are free
+int coalesce_blocks(void**,int);
+
+// class of a buffer size
+int class_of(int);
 
-// check if the nth bit of a bitfield (represented by a byte array) is 1 or 0
-bool test_nth_bit(int,char[]);
+// the buffer size that serves a request
+int block_size(kma_size_t);
+
+// set or clear a buffer-aligned run of bits
+void mark_range(unsigned long[], int, int, mem_status_t);
+
+// check that a buffer-aligned run of bits is all clear (free)
+bool range_free(unsigned long[], int, int);
+
+// check that a buffer is all free, whatever its size
+bool block_free(void*, int);
 
-//void* request_full_page(int);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -117,264 +173,309 @@ bool test_nth_bit(int,char[]);
 void*
 kma_malloc(kma_size_t size)
 {
-  if (!pages) {
-    initializepages();
+  if (size > MAXBLOCK) {
+    // huge objects get their own run of pages
+    kpage_t* page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+    return page->ptr;
   }
-  size = size + sizeof(int);
-  void* addr;
   
-  if (size > PAGESIZE-sizeof(page_t)-sizeof(kpage_t)-sizeof(freelist_t)) {
-    kpage_t* page = get_page();
-    *((kpage_t**)page->ptr) = page;
-    if ((size + sizeof(kpage_t*)) > page->size)
-    { // requested size too large
-      free_page(page);
-      return NULL;
-    }
-    return page->ptr + sizeof(kpage_t*);
+  if (!initialized) {
+    initializepages();
   }
+  size = block_size(size);
+  void* addr;
   
   addr = get_free_block(size);
   
-  if (addr != NULL) {
-    update_bitmap(addr-sizeof(int), *((int*)(addr-sizeof(int))), MEM_USED);
-    return addr;
-  }
-  allocate_new_page();
-  
-  addr = get_free_block(size);
-  if (addr != NULL) {
-    update_bitmap(addr-sizeof(int), *((int*)(addr-sizeof(int))), MEM_USED);
-    return addr;
+  if (addr == NULL) {
+    allocate_new_region(size);
+    addr = get_free_block(size);
   }
-  return NULL;
+  update_bitmap(addr, size, MEM_USED);
+  return addr;
 }
 
 void 
 kma_free(void* ptr, kma_size_t size)
 {
-  freelist_t* list = (freelist_t *)(pages->ptr + sizeof(page_t));
-  if (size > PAGESIZE-sizeof(page_t)-sizeof(kpage_t)-sizeof(freelist_t)-sizeof(int)) {
-    kpage_t* page = *((kpage_t**)(ptr - sizeof(kpage_t*)));
-    free_page(page);
+  if (size > MAXBLOCK) {
+    free_pages(kpage_of(ptr));
     return;
   }
   
-  ptr = (ptr - sizeof(int));
-  int mysize = *((int *) ptr); // size INCLUDES header ptr
+  int mysize = block_size(size);
+  // the buffer must be aligned to that size and in use
+  assert(((ptr - META(ptr)->region) & (mysize - 1)) == 0);
+  assert(!block_free(ptr, 1 << MINORDER));
   
   update_bitmap(ptr, mysize, MEM_FREE);
-  mysize = coalesce_blocks(ptr,mysize);
-  
-  //printf("size == %d mysize == %d\n",size,mysize);
-  addtofreelist(ptr, mysize);
+  mysize = coalesce_blocks(&ptr,mysize);
   
-  list->allocs--;
-  if (list->allocs <= 0)
-    freekpages();
-}
-
-void
-freekpages()
-{
-  page_t* p = pages->ptr;
-  page_t* next_p;
-  while (p != NULL) {
-    next_p = p->nextpage;
-    (p->me)->ptr = (void*)p;
-    free_page(p->me);
-    p = next_p;
+  if (mysize == META(ptr)->regionsize) {
+    free_region(ptr);
+  } else {
+    addtofreelist(ptr, mysize);
   }
-  pages = NULL;
 }
 
 void* 
-get_free_block(kma_size_t size) //size INCLUDES header ptr
+get_free_block(kma_size_t size)
 {
-  freelist_t* list = (freelist_t*)(pages->ptr + sizeof(page_t));
-  if (size > list->bufsizes[9]) {
-    return NULL;
-  }
-  int i=0;
-  while (list->bufsizes[i] < size) {
-    i++;
-  }
+  int i = class_of(size);
   int idx = i;
-  while (list->lists[i] == NULL) {
+  while (freelist.lists[i] == NULL) {
     i++;
-    if (i == 10) {
+    if (i == freelist.nclasses) {
       return NULL; //no more space
     }
   }
+  void* addr = freelist.lists[i];
+  removefromfreelist(addr, freelist.bufsizes[i]);
+  // split, keeping the lower half
   while (i > idx) {
-    void* addr = list->lists[i];
-    void* nextaddr = *((void**)addr);
-    list->lists[i] = nextaddr;
-    
-    nextaddr = list->lists[i-1];
-    list->lists[i-1] = addr;
-    if (i == 9) { // special case, because bufsizes[9] != bufsizes[8]*2
-      *((void**)addr) = nextaddr;
-    } else {
-      *((void**)addr) = addr + list->bufsizes[i-1];
-      addr = *((void**)addr);
-      *((void**)addr) = nextaddr;
-    }
-    
     i--;
+    addtofreelist(addr + freelist.bufsizes[i], freelist.bufsizes[i]);
   }
-  void* returnaddr = list->lists[idx];
-  list->lists[idx] = *((void**)returnaddr);
-  *((int*)returnaddr) = list->bufsizes[idx];
-  list->allocs++;
-  return returnaddr+sizeof(int);
+  return addr;
 }
 
 void initializepages()
 {
-  int effectivePagesize = (unsigned int)PAGESIZE - sizeof(kpage_t) - sizeof(page_t) - sizeof(freelist_t);
-  kpage_t* new_kpage = get_page();
-  page_t* new_page = (page_t *)(new_kpage->ptr);
+  int i;
+  int size = 1 << MINORDER;
+  for(i = 0; i < MAXCLASSES; i++) {
+    freelist.bufsizes[i] = size;
+    freelist.lists[i] = NULL;
+    size *= 2;
+  }
+  freelist.nclasses = MAXCLASSES;
+  initialized = TRUE;
+}
+
+void allocate_new_region(int size)
+{
+  int regionsize = PAGESIZE;
   
-  new_page->me = new_kpage;
-  new_page->nextpage = NULL;
-  pages = new_kpage;
+  // a region is one buffer of a whole number of pages
+  while (regionsize < size) {
+    regionsize *= 2;
+  }
   
-  freelist_t* list = (freelist_t*)((void *)new_page + sizeof(page_t));
-  list->allocs = 0;
+  kpage_t* run = get_pages(regionsize / PAGESIZE);
+  void* page;
   
-  int i;
-  int size = 16;
-  for(i = 0; i < 10; i++) {
-    list->bufsizes[i] = size;
-    list->lists[i] = NULL;
-    size *= 2;
+  for (page = run->ptr; page < run->ptr + regionsize; page += PAGESIZE) {
+    pagemeta_t* meta = get_meta();
+    meta->region = run->ptr;
+    meta->regionsize = regionsize;
+    memset(meta->bitmap, 0, BITMAPSIZE);
+    kpage_of(page)->priv = meta;
   }
-  for (i = 0; i < 128; i++) {
-    new_page->bitmap[i] = 0;
+  addtofreelist(run->ptr, regionsize);
+}
+
+void free_region(void* region)
+{
+  int regionsize = META(region)->regionsize;
+  void* page;
+  
+  for (page = region; page < region + regionsize; page += PAGESIZE) {
+    put_meta(META(page));
   }
-  list->bufsizes[9] = effectivePagesize;
-  void* nextaddr = (void*)new_page + sizeof(page_t) + sizeof(freelist_t);
-  addtofreelist(nextaddr,list->bufsizes[9]);
+  free_pages(kpage_of(region));
 }
 
-void allocate_new_page()
+pagemeta_t* get_meta()
 {
-  int effectivePagesize = (unsigned int)PAGESIZE - sizeof(kpage_t) - sizeof(page_t) - sizeof(freelist_t);
+  metapage_t* meta = metapages;
+  void* slot;
   
-  kpage_t* new_kpage = get_page();
-  page_t* new_page = (page_t *)(new_kpage->ptr);
-  new_kpage->ptr = (void*)new_page;
+  if (meta == NULL) {
+    int i;
+    
+    meta = get_page()->ptr;
+    meta->next = meta->prev = NULL;
+    meta->used = 0;
+    meta->freeslots = NULL;
+    for (i = (PAGESIZE - sizeof(metapage_t)) / SLOTSIZE - 1; i >= 0; i--) {
+      slot = (void*)meta + sizeof(metapage_t) + i * SLOTSIZE;
+      *((void**)slot) = meta->freeslots;
+      meta->freeslots = slot;
+    }
+    metapages = meta;
+  }
   
-  new_page->me = new_kpage;
-  new_page->nextpage = NULL;
-  int i;
-  for (i = 0; i < 128; i++) {
-    new_page->bitmap[i] = 0;
+  slot = meta->freeslots;
+  meta->freeslots = *((void**)slot);
+  meta->used++;
+  
+  // full: off the list
+  if (meta->freeslots == NULL) {
+    metapages = meta->next;
+    if (metapages != NULL)
+      metapages->prev = NULL;
   }
+  return slot;
+}
+
+void put_meta(pagemeta_t* slot)
+{
+  metapage_t* meta = BASEADDR(slot);
   
-  page_t* old_page = (page_t*)(pages->ptr);
-  while (old_page->nextpage != NULL) {
-    old_page = old_page->nextpage;
+  if (meta->freeslots == NULL) {
+    // was full: back on the list
+    meta->prev = NULL;
+    meta->next = metapages;
+    if (metapages != NULL)
+      metapages->prev = meta;
+    metapages = meta;
   }
-  old_page->nextpage = new_page;
+  *((void**)slot) = meta->freeslots;
+  meta->freeslots = slot;
   
-  // don't really need to add sizeof(freelist_t), but max. buffer size will be bufsizes[9] regardless so might as well do it for consistency
-  void* effectiveStartAddr = (void*)(new_page) + sizeof(page_t) + sizeof(freelist_t);
-  addtofreelist(effectiveStartAddr,effectivePagesize);
+  if (--meta->used == 0) {
+    if (meta->prev != NULL)
+      meta->prev->next = meta->next;
+    else
+      metapages = meta->next;
+    if (meta->next != NULL)
+      meta->next->prev = meta->prev;
+    free_page(kpage_of(meta));
+  }
 }
 
-void addtofreelist(void* addr, int size) // size INCLUDES head ptr
+void addtofreelist(void* addr, int size)
 {
-  freelist_t* list = (freelist_t*)(pages->ptr + sizeof(page_t));
-  int i;
-  for (i = 0; i < 10; i ++) {
-    if (size == list->bufsizes[i]) {
-      *((void **)addr) = list->lists[i];
-      list->lists[i] = addr;
-      break;
-    }
+  int i = class_of(size);
+  block_t* b = (block_t*)addr;
+  
+  b->next = freelist.lists[i];
+  b->prev = NULL;
+  if (b->next != NULL)
+    b->next->prev = b;
+  freelist.lists[i] = b;
+}
+
+void removefromfreelist(void* addr, int size)
+{
+  block_t* b = (block_t*)addr;
+  
+  if (b->next != NULL)
+    b->next->prev = b->prev;
+  if (b->prev != NULL) {
+    b->prev->next = b->next;
+    return;
   }
+  // first on its list
+  freelist.lists[class_of(size)] = b->next;
+}
+
+int class_of(int size)
+{
+  // powers of two from 16 up
+  return __builtin_ctz(size) - MINORDER;
+}
+
+int block_size(kma_size_t size)
+{
+  // the next power of two, 16 at least
+  return size <= (1 << MINORDER) ? 1 << MINORDER : 1 << (32 - __builtin_clz(size - 1));
 }
 
 // update the bitmap representing used/free memory regions
 void update_bitmap(void* ptr, kma_size_t size, mem_status_t status) {
+  void* end = ptr + size;
   
-  page_t* page = (page_t*)(pages->ptr);
-  while (ptr < (void*)page || ptr > (void*)page+PAGESIZE-sizeof(kpage_t)) {
-    page = (page_t*)(page->nextpage);
+  if (size < PAGESIZE) {
+    int offset = ptr - BASEADDR(ptr);
+    mark_range(META(ptr)->bitmap, offset/16, size/16, status);
+    return;
   }
-  int offset = (ptr - (void*)page) - sizeof(page_t) - sizeof(freelist_t);
-  int i;
-  if (status == MEM_USED) {
-    for (i = offset/16; i < offset/16 + size/16; i++) {
-      page->bitmap[i/8] |= (1 << (7 - (i%8))); 
-    }
+  // a multi-page buffer covers whole bitmaps
+  for (; ptr < end; ptr += PAGESIZE) {
+    memset(META(ptr)->bitmap, status == MEM_USED ? 0xff : 0, BITMAPSIZE);
   }
-  else {
-    for (i = offset/16; i < offset/16 + size/16; i++) {
-      page->bitmap[i/8] &= ~(1 << (7 - (i%8))); 
-    }
+}
+
+void mark_range(unsigned long bitmap[], int bit, int n, mem_status_t status) {
+  // buffers are aligned to their size, so a run shorter than a word
+  // never crosses one
+  if (n < WORDBITS) {
+    unsigned long mask = ((1UL << n) - 1) << (bit % WORDBITS);
+    if (status == MEM_USED)
+      bitmap[bit / WORDBITS] |= mask;
+    else
+      bitmap[bit / WORDBITS] &= ~mask;
+    return;
   }
+  memset(&bitmap[bit / WORDBITS], status == MEM_USED ? 0xff : 0, n / 8);
 }
 
-// coalesce memory regions, if possible
-int coalesce_blocks(void* ptr, int size) {
-  //return size;
-  freelist_t* list = (freelist_t*)(pages->ptr + sizeof(page_t));
-  if (2*size > list->bufsizes[9]) {
-    return size;
+bool range_free(unsigned long bitmap[], int bit, int n) {
+  unsigned long* w = &bitmap[bit / WORDBITS];
+  int i = 0;
+  
+  if (n < WORDBITS) {
+    unsigned long mask = ((1UL << n) - 1) << (bit % WORDBITS);
+    return (*w & mask) == 0;
   }
-  // find page for ptr
-  page_t* page = (page_t*)(pages->ptr);
-  while (ptr < ((void*)page+sizeof(page_t)+sizeof(freelist_t)) || ptr > (void*)page+PAGESIZE-sizeof(kpage_t)) {
-    page = (page_t*)(page->nextpage);
+#ifdef __AVX2__
+  // four words per step for the big buffers
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 4 <= n / WORDBITS; i += 4) {
+    acc = _mm256_or_si256(acc, _mm256_loadu_si256((__m256i*)(w + i)));
   }
-  int offset = (ptr - (void*)page) - sizeof(page_t) - sizeof(freelist_t);
-  
-  void* oldptr;
-  int startbit;
-  // calculate location of buddy ptr
-  if ((offset/size) % 2 == 0) {
-    startbit = offset/16 + size/16;
-    oldptr = ptr + size;
-  } else {
-    startbit = offset/16 - size/16;
-    oldptr = ptr - size;
+  if (!_mm256_testz_si256(acc, acc)) {
+    return FALSE;
   }
-  int i;
-  // check if all bits in the range are empty
-  for (i=0; i < size/16; i++) {
-    if (test_nth_bit(startbit+i,page->bitmap) != 0) {
-      return size;
+#endif
+  for (; i < n / WORDBITS; i++) {
+    if (w[i] != 0) {
+      return FALSE;
     }
   }
-  // if we reach this point, we can maybe coalesce
-  for (i=0; list->bufsizes[i] != size; i++) {}
-  void* curptr = list->lists[i];
+  return TRUE;
+}
+
+bool block_free(void* ptr, int size) {
+  void* end = ptr + size;
   
-    while (curptr != NULL && curptr > ((void*)page+sizeof(page_t)+sizeof(freelist_t)) && curptr < (void*)page+PAGESIZE-sizeof(kpage_t)) {
-      
-      if (*((void**)curptr) == oldptr) {
-        *((void**)curptr) = *((void**)oldptr);
-
-        if (oldptr < ptr) {
-          ptr = oldptr;
-        }
-        return 2*size;
-      }
-      curptr = *((void**)curptr);
+  if (size < PAGESIZE) {
+    int offset = ptr - BASEADDR(ptr);
+    return range_free(META(ptr)->bitmap, offset/16, size/16);
+  }
+  for (; ptr < end; ptr += PAGESIZE) {
+    if (!range_free(META(ptr)->bitmap, 0, PAGESIZE/16)) {
+      return FALSE;
     }
-  return size;
+  }
+  return TRUE;
 }
 
-bool test_nth_bit(int n,char bitmap[128]) {
-  int i=0;
-  while (n >= sizeof(char)) {
-    i++;
-    n -= sizeof(char);
+// coalesce a free buffer with its buddy, and the result with its buddy,
+// for as long as the buddy is free; returns the merged size and moves
+// *pptr to the merged buffer
+int coalesce_blocks(void** pptr, int size) {
+  void* ptr = *pptr;
+  pagemeta_t* meta = META(ptr);
+  void* region = meta->region;
+  
+  while (size < meta->regionsize) {
+    int offset = ptr - region;
+    // the buddy differs from us in just the size bit
+    int buddy = offset ^ size;
+    
+    // free buffers are always fully coalesced, so a free range the size
+    // of the buddy is the buddy itself
+    if (!block_free(region + buddy, size)) {
+      break;
+    }
+    removefromfreelist(region + buddy, size);
+    ptr = region + (offset & ~size);
+    size *= 2;
   }
-  return (bitmap[i] & (1 << (7 - n)));
+  *pptr = ptr;
+  return size;
 }
 
 #endif // KMA_BUD
@@ -75,17 +75,9 @@ void* kma_malloc(kma_size_t size)
 
   kpage_t* page;
   
-  // get one page
-  page = get_page();
-  
-  // add a pointer to the page structure at the beginning of the page
-  *((kpage_t**)page->ptr) = page;
-  
-  if ((size + sizeof(kpage_t*)) > page->size)
-    { // requested size too large
-      free_page(page);
-      return NULL;
-    }
+  // get just enough contiguous pages; the page layer finds the
+  // descriptor again from the address, so no header is needed
+  page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
   
   // check whether the BASEADDR macro works
   //for (i = 0; i < page->size; i++)
@@ -94,16 +86,12 @@ void* kma_malloc(kma_size_t size)
   //}
   // oh yea, it worked
   
-  return page->ptr + sizeof(kpage_t*);
+  return page->ptr;
 }
 
 void kma_free(void* ptr, kma_size_t size)
 {
-  kpage_t* page;
-  
-  page = *((kpage_t**)(ptr - sizeof(kpage_t*)));
-  
-  free_page(page);
+  free_pages(kpage_of(ptr));
 }
 
 #endif // KMA_DUMMY
@@ -41,7 +41,9 @@
 
 /************System include***********************************************/
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kpage.h"
@@ -54,10 +56,87 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// Each page is a buddy system of blocks from 16 bytes to half a page,
+// minus a header that holds one bit per 16 byte granule (set while the
+// granule belongs to a globally free block). A freed buffer is either
+// kept "locally free" on its class list, still marked allocated in the
+// bitmap so it never coalesces, or released "globally free" and merged
+// with its buddies at once. The choice follows the class's slack,
+// allocated minus locally free buffers: while the slack is at least 2
+// the free is lazy, at 1 the buffer is coalesced, and at 0 a locally
+// free buffer is coalesced along with it.
+
+#define MINORDER 4
+// 16 .. MAXPAGESIZE/2
+#define MAXORDERS 16
+
+#define BLOCKSIZE(o) (1 << (o))
+
+// free buffer, linked on a class list
+typedef struct buf
+{
+  struct buf* next;
+  struct buf* prev;
+} buf_t;
+
+typedef struct
+{
+  buf_t local;     // locally free buffers, sentinel
+  buf_t global;    // globally free blocks, sentinel
+  int allocated;   // buffers handed out
+  int nlocal;      // locally free buffers
+} class_t;
+
+typedef struct
+{
+  int used;                // blocks handed out, locally free ones included
+  unsigned long bitmap[];  // one bit per 16 byte granule
+} page_t;
+
+#define WORDBITS (8 * sizeof(unsigned long))
+
 /************Global Variables*********************************************/
 
+static class_t classes[MAXORDERS];
+static bool ready = FALSE;
+
+// log2(PAGESIZE), and the header size, rounded up to a power of two so
+// the blocks after it stay aligned
+static int pageorder;
+static int pagehdr;
+
+// KMA_LZBUD_LAZY=0 coalesces on every free, as the plain buddy system
+static bool lazy = TRUE;
+
+// buddy work done, printed on exit with KMA_LZBUD_STATS=1
+static int nsplits = 0;
+static int ncoalesces = 0;
+
 /************Function Prototypes******************************************/
 
+// read the configuration and set the classes up
+void init_classes();
+
+// order of the smallest block holding size bytes
+int order_of(kma_size_t);
+
+// take a block of the given order from the buddy system
+void* buddy_alloc(int);
+
+// return a block to the buddy system, coalescing it with its buddies
+void buddy_free(void*, int);
+
+// get a page and put its blocks on the global lists
+void new_page();
+
+// bitmap operations on the block at offset off of the given order
+bool range_free(page_t*, int, int);
+void mark_range(page_t*, int, int, bool);
+
+// list operations
+void push(buf_t*, buf_t*);
+void unlink_buf(buf_t*);
+
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -65,13 +144,248 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  class_t* c;
+  buf_t* b;
+  int o;
+  
+  if (!ready) {
+    init_classes();
+  }
+  
+  o = order_of(size);
+  if (o >= pageorder) {
+    // too big for a page's buddy system: a run of whole pages
+    return get_pages((size + PAGESIZE - 1) / PAGESIZE)->ptr;
+  }
+  
+  c = &classes[o];
+  c->allocated++;
+  
+  // a locally free buffer is still allocated as far as the buddy system
+  // knows, so it can be handed out again without any splitting
+  if (c->local.next != &c->local) {
+    b = c->local.next;
+    unlink_buf(b);
+    c->nlocal--;
+    return b;
+  }
+  
+  return buddy_alloc(o);
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  int o = order_of(size);
+  class_t* c;
+  int slack;
+  
+  if (o >= pageorder) {
+    free_pages(kpage_of(ptr));
+    return;
+  }
+  
+  c = &classes[o];
+  slack = c->allocated - c->nlocal;
+  c->allocated--;
+  
+  if (lazy && slack >= 2) {
+    push(&c->local, ptr);
+    c->nlocal++;
+  } else if (!lazy || slack == 1) {
+    buddy_free(ptr, o);
+  } else {
+    buf_t* b = c->local.next;
+    
+    buddy_free(ptr, o);
+    unlink_buf(b);
+    c->nlocal--;
+    buddy_free(b, o);
+  }
+}
+
+void
+init_classes()
+{
+  char* env = getenv("KMA_LZBUD_LAZY");
+  int o;
+  
+  if (env != NULL && strcmp(env, "0") == 0) {
+    lazy = FALSE;
+  }
+  
+  for (o = 0; o < MAXORDERS; o++) {
+    classes[o].local.next = classes[o].local.prev = &classes[o].local;
+    classes[o].global.next = classes[o].global.prev = &classes[o].global;
+    classes[o].allocated = 0;
+    classes[o].nlocal = 0;
+  }
+  
+  pageorder = __builtin_ctz(PAGESIZE);
+  pagehdr = BLOCKSIZE(MINORDER);
+  while (pagehdr < sizeof(page_t) + PAGESIZE / 16 / 8) {
+    pagehdr *= 2;
+  }
+  
+  ready = TRUE;
+}
+
+int
+order_of(kma_size_t size)
+{
+  if (size <= BLOCKSIZE(MINORDER)) {
+    return MINORDER;
+  }
+  return (8 * sizeof(int)) - __builtin_clz(size - 1);
+}
+
+void*
+buddy_alloc(int o)
+{
+  class_t* c;
+  buf_t* b;
+  int k = o;
+  
+  while (k < pageorder && classes[k].global.next == &classes[k].global) {
+    k++;
+  }
+  if (k == pageorder) {
+    new_page();
+    k = pageorder - 1;
+  }
+  
+  c = &classes[k];
+  b = c->global.next;
+  unlink_buf(b);
+  mark_range(BASEADDR(b), (void*)b - BASEADDR(b), k, FALSE);
+  
+  // split, keeping the lower half and freeing the upper one
+  while (k > o) {
+    buf_t* half;
+    
+    k--;
+    half = (buf_t*)((void*)b + BLOCKSIZE(k));
+    mark_range(BASEADDR(b), (void*)half - BASEADDR(b), k, TRUE);
+    push(&classes[k].global, half);
+    nsplits++;
+  }
+  
+  ((page_t*)BASEADDR(b))->used++;
+  return b;
+}
+
+void
+buddy_free(void* ptr, int o)
+{
+  page_t* page = BASEADDR(ptr);
+  int off = ptr - (void*)page;
+  
+  while (o < pageorder - 1) {
+    int buddy = off ^ BLOCKSIZE(o);
+    
+    // blocks are always fully coalesced, so a free buddy-sized range is
+    // exactly the buddy (the header is never marked free)
+    if (!range_free(page, buddy, o)) {
+      break;
+    }
+    unlink_buf((void*)page + buddy);
+    mark_range(page, buddy, o, FALSE);
+    ncoalesces++;
+    off &= ~BLOCKSIZE(o);
+    o++;
+  }
+  
+  mark_range(page, off, o, TRUE);
+  push(&classes[o].global, (void*)page + off);
+  
+  // with nothing handed out, the page is back to the blocks new_page()
+  // carved it into
+  if (--page->used == 0) {
+    for (off = pagehdr; off < PAGESIZE; off *= 2) {
+      unlink_buf((void*)page + off);
+    }
+    free_page(kpage_of(page));
+  }
+}
+
+void
+new_page()
+{
+  page_t* page = get_page()->ptr;
+  int off;
+  int o;
+  
+  page->used = 0;
+  memset(page->bitmap, 0, PAGESIZE / 16 / 8);
+  
+  // whatever follows the header, as blocks of growing order
+  for (off = pagehdr, o = __builtin_ctz(pagehdr); off < PAGESIZE; off *= 2, o++) {
+    mark_range(page, off, o, TRUE);
+    push(&classes[o].global, (void*)page + off);
+  }
+}
+
+bool
+range_free(page_t* page, int off, int o)
+{
+  int bit = off / 16;
+  int n = BLOCKSIZE(o - MINORDER);
+  int i;
+  
+  if (n < WORDBITS) {
+    unsigned long mask = ((1UL << n) - 1) << (bit % WORDBITS);
+    return (page->bitmap[bit / WORDBITS] & mask) == mask;
+  }
+  for (i = bit / WORDBITS; i < (bit + n) / WORDBITS; i++) {
+    if (page->bitmap[i] != ~0UL) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+void
+mark_range(page_t* page, int off, int o, bool set)
+{
+  int bit = off / 16;
+  int n = BLOCKSIZE(o - MINORDER);
+  int i;
+  
+  if (n < WORDBITS) {
+    unsigned long mask = ((1UL << n) - 1) << (bit % WORDBITS);
+    if (set)
+      page->bitmap[bit / WORDBITS] |= mask;
+    else
+      page->bitmap[bit / WORDBITS] &= ~mask;
+    return;
+  }
+  for (i = bit / WORDBITS; i < (bit + n) / WORDBITS; i++) {
+    page->bitmap[i] = set ? ~0UL : 0;
+  }
+}
+
+void
+push(buf_t* list, buf_t* b)
+{
+  b->next = list->next;
+  b->prev = list;
+  list->next->prev = b;
+  list->next = b;
+}
+
+void
+unlink_buf(buf_t* b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+__attribute__((destructor)) static void
+print_stats()
+{
+  if (getenv("KMA_LZBUD_STATS") != NULL) {
+    fprintf(stderr, "Buddy splits/coalesces: %d/%d\n", nsplits, ncoalesces);
+  }
 }
 
 #endif // KMA_LZBUD
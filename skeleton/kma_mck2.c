@@ -54,10 +54,60 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// Every page holds buffers of a single power-of-two size, so objects
+// carry no header at all: the size of a buffer is looked up in the
+// kmemusage table, indexed by the page the buffer lives in.
+
+// smallest buffer is 16 bytes (two list pointers); the largest bucket
+// is half of the biggest page, bigger requests get whole pages
+#define MINBUCKET 4
+#define MAXBUCKETS 12
+
+// kmemusage.indx for pages not owned by a bucket
+#define KMEM_FREE  -1
+#define KMEM_LARGE -2
+
+// free buffer, linked on its bucket's list
+typedef struct buf
+{
+  struct buf* next;
+  struct buf* prev;
+} buf_t;
+
+// per-page usage, one entry for every page of an arena
+typedef struct
+{
+  short indx;     // bucket of the page's buffers, or KMEM_FREE/KMEM_LARGE
+  short freecnt;  // free buffers in the page
+} kmemusage_t;
+
+#define KMEMUSAGE(x) (&kmemusage[page_arena(x)][ARENAPAGE(x)])
+
 /************Global Variables*********************************************/
 
+// free lists, circular with the bucket itself as sentinel
+static buf_t buckets[MAXBUCKETS];
+static bool buckets_ready = FALSE;
+
+// page-indexed usage tables, allocated per arena while the arena holds
+// pages of ours
+static kmemusage_t* kmemusage[MAXARENAS];
+static int arena_pages[MAXARENAS];
+
 /************Function Prototypes******************************************/
 
+// bucket index for a request size
+int bucket_of(kma_size_t);
+
+// get a page (or run) for a bucket and account for it in kmemusage
+void* take_pages(int, short);
+
+// drop a page (or run) from kmemusage and free it
+void give_pages(void*);
+
+// carve a fresh page into buffers for a bucket
+void fill_bucket(int);
+
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -65,13 +115,135 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  int indx;
+  buf_t* b;
+  
+  if (!buckets_ready) {
+    for (indx = 0; indx < MAXBUCKETS; indx++) {
+      buckets[indx].next = &buckets[indx];
+      buckets[indx].prev = &buckets[indx];
+    }
+    buckets_ready = TRUE;
+  }
+  
+  // too big for a bucket: a run of whole pages
+  if (size > PAGESIZE / 2) {
+    return take_pages((size + PAGESIZE - 1) / PAGESIZE, KMEM_LARGE);
+  }
+  
+  indx = bucket_of(size);
+  if (buckets[indx].next == &buckets[indx]) {
+    fill_bucket(indx);
+  }
+  
+  b = buckets[indx].next;
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  KMEMUSAGE(b)->freecnt--;
+  
+  return b;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  kmemusage_t* kup = KMEMUSAGE(ptr);
+  buf_t* bucket;
+  buf_t* b;
+  int bufsize;
+  int i;
+  
+  assert(kup->indx != KMEM_FREE);
+  
+  if (kup->indx == KMEM_LARGE) {
+    give_pages(ptr);
+    return;
+  }
+  
+  bucket = &buckets[kup->indx];
+  bufsize = 1 << (kup->indx + MINBUCKET);
+  
+  b = (buf_t*)ptr;
+  b->next = bucket->next;
+  b->prev = bucket;
+  bucket->next->prev = b;
+  bucket->next = b;
+  
+  // once every buffer of the page is free, pull them all off the bucket
+  // list (O(buffers per page), thanks to the back links) and return it
+  if (++kup->freecnt == PAGESIZE / bufsize) {
+    void* page = BASEADDR(ptr);
+    for (i = 0; i < PAGESIZE / bufsize; i++) {
+      b = (buf_t*)(page + i * bufsize);
+      b->next->prev = b->prev;
+      b->prev->next = b->next;
+    }
+    give_pages(page);
+  }
+}
+
+int
+bucket_of(kma_size_t size)
+{
+  if (size <= (1 << MINBUCKET)) {
+    return 0;
+  }
+  // ceil(log2(size)) - MINBUCKET
+  return (8 * sizeof(int)) - __builtin_clz(size - 1) - MINBUCKET;
+}
+
+void*
+take_pages(int n, short indx)
+{
+  kpage_t* page = get_pages(n);
+  int arena = page_arena(page->ptr);
+  kmemusage_t* kup;
+  
+  if (kmemusage[arena] == NULL) {
+    int bytes = ARENAPAGES * sizeof(kmemusage_t);
+    kmemusage[arena] = get_pages((bytes + PAGESIZE - 1) / PAGESIZE)->ptr;
+  }
+  arena_pages[arena]++;
+  
+  kup = KMEMUSAGE(page->ptr);
+  kup->indx = indx;
+  kup->freecnt = 0;
+  
+  return page->ptr;
+}
+
+void
+give_pages(void* page)
+{
+  int arena = page_arena(page);
+  
+  KMEMUSAGE(page)->indx = KMEM_FREE;
+  free_pages(kpage_of(page));
+  
+  // the usage table goes once its arena holds none of our pages
+  if (--arena_pages[arena] == 0) {
+    free_pages(kpage_of(kmemusage[arena]));
+    kmemusage[arena] = NULL;
+  }
+}
+
+void
+fill_bucket(int indx)
+{
+  int bufsize = 1 << (indx + MINBUCKET);
+  void* page = take_pages(1, indx);
+  buf_t* bucket = &buckets[indx];
+  int i;
+  
+  // thread the buffers onto the bucket in address order
+  for (i = PAGESIZE / bufsize - 1; i >= 0; i--) {
+    buf_t* b = (buf_t*)(page + i * bufsize);
+    b->next = bucket->next;
+    b->prev = bucket;
+    bucket->next->prev = b;
+    bucket->next = b;
+  }
+  KMEMUSAGE(page)->freecnt = PAGESIZE / bufsize;
 }
 
 #endif // KMA_MCK2
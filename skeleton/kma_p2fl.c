@@ -55,55 +55,93 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
-// holds total allocations and pointers into the free list
-// goes in first page allocated
-typedef struct
-{
-  int allocs;
-  int bufsizes[10];
-  void* lists[10];
-} freelist_t;
-
-// page header for every page
-// keeps a linked list of pages, and allocations for this page
-typedef struct
+// Buffer sizes are multiples of 16, so every buffer is 16 byte
+// aligned: 16, 32, 48, 64, then quarter steps of each power of two (80,
+// 96, 112, 128, 160, ...) up to half of the largest page size; bigger
+// requests get their own run of pages. The sizes are fixed, but which
+// ones fit and how many pages each class's runs take depend on the page
+// size, known only at run time.
+#define MINORDER 4
+#define MAXCLASSES 40
+
+// the classes below 64 bytes, and the quarter steps above 64 << g
+#define SMALLCLASSES 4
+#define SMALLMAX (SMALLCLASSES << MINORDER)
+#define QUARTERS(g) (80 << (g)), (96 << (g)), (112 << (g)), (128 << (g))
+
+// a class's runs are the fewest pages, up to MAXRUNPAGES, that waste at
+// most RUNWASTE percent of the run; failing that, the least wasteful
+#define MAXRUNPAGES 8
+#define RUNWASTE 12
+
+// a request whose class is empty takes a buffer from at most MAXBORROW
+// classes above its own before it starts a new run, so above 64 bytes
+// its buffer is less than 7/4 of its size
+#define MAXBORROW 2
+
+// Every run of pages holds buffers of a single class and keeps its own
+// free list, so a run whose buffers have all come back is released
+// without looking at any other. Each class keeps the runs that have
+// free buffers on a circular list, fuller ones towards the front: a run
+// goes to the front when it stops being full, and to the back once
+// more than half of it is free. Allocation takes from the front, so
+// nearly empty runs get a chance to drain. Buffers have no header: the
+// descriptor of each page of a run points at the run's header, which
+// has the class. A new run is carved lazily: buffers that have never
+// been handed out are taken from a bump pointer, so only buffers that
+// have been freed are ever on the run's free list, and a fresh run
+// costs no more than an allocation until its memory is used.
+typedef struct page
 {
-  kpage_t* me;
-  void* nextpage;
+  struct page* nextpage;
+  struct page* prevpage;
   int pageallocs;
+  int nbufs;
+  int cls;
+  void* freebufs;
+  void* bump;              // next never-used buffer; the run ends there
+                           // once all have been handed out
 } page_t;
 
-typedef enum
+// bit i of nonempty is set while class i has a run with a free buffer
+typedef struct
 {
-  NORMAL,
-  BIG,
-  HUGE
-} page_size_t;
+  int nclasses;
+  unsigned long nonempty;
+  int runpages[MAXCLASSES];
+  int runbufs[MAXCLASSES];
+  page_t partial[MAXCLASSES];
+} freelist_t;
 
+#define PAGEOF(ptr) ((page_t*)kpage_of(ptr)->priv)
 
 /************Global Variables*********************************************/
 
-static kpage_t* pages = 0;
-
-/************Function Prototypes******************************************/
+static const int kbufsizes[MAXCLASSES] = {
+  16, 32, 48, 64,
+  QUARTERS(0), QUARTERS(1), QUARTERS(2), QUARTERS(3),
+  QUARTERS(4), QUARTERS(5), QUARTERS(6), QUARTERS(7),
+  QUARTERS(8)
+};
 
-// get the first page and add freelist struct
-void initializepages();
+static freelist_t list;
+static bool initialized = FALSE;
 
-// add a buffer to the free list
-void addtofreelist(void*, int); 
+/************Function Prototypes******************************************/
 
-// try to alloc by using the free list
-void* allocintofreelist(kma_size_t);
+// set up the classes; the page size is only known at run time
+void initializeclasses();
 
-// get another page and add buffers to the free lists
-void allocate_new_page(page_size_t);
+// the class of the smallest buffers that hold size bytes
+int classof(kma_size_t);
 
-// free all the kpages we've gotten
-void freekpages();
+// get another run of pages and carve it into buffers of a class
+page_t* allocate_new_page(int);
 
-// free a single kpage and remove it from the list
-void freeonepage(page_t* page);
+// link a page at the front or the back of its class's partial list,
+// and unlink it
+void pushpage(page_t*, bool);
+void unlinkpage(page_t*);
 
 /************External Declaration*****************************************/
 
@@ -113,230 +151,162 @@ void freeonepage(page_t* page);
 void*
 kma_malloc(kma_size_t size)
 {
-
-  //printf("allocating: %d\n", (unsigned int)size);
-
-  if (!pages) {
-    initializepages();
+  // too big for any buffer: give it its own run of pages
+  if (size > PAGESIZE / 2) {
+    kpage_t* run = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+    return run->ptr;
   }
 
-  size = size + 4;
-  
-  void* addr = allocintofreelist(size);
- 
-  if (addr != NULL) {
-    return addr;
+  if (!initialized) {
+    initializeclasses();
   }
-  
-  // if there isn't space in the free list, we need a new page
-  // allocate buffers to the free list depending on the buffer needed
-  if (size <= 2048) {
-    allocate_new_page(NORMAL);
-  } else if (size <= 4096) {
-    allocate_new_page(BIG);
-  } else if (size <= (8192 - sizeof(page_t))) {
-    allocate_new_page(HUGE);
+
+  // the first class with a free buffer from the size's own to MAXBORROW
+  // above it; if there is none, we need a new page
+  int i = classof(size);
+  unsigned long candidates =
+    list.nonempty & (~0UL << i) & ~(~0UL << (i + MAXBORROW + 1));
+  page_t* page;
+  if (candidates != 0) {
+    i = __builtin_ctzl(candidates);
+    page = list.partial[i].nextpage;
+  } else {
+    page = allocate_new_page(i);
   }
 
-  addr = allocintofreelist(size);
+  void* addr = page->freebufs;
   if (addr != NULL) {
-    return addr;
+    page->freebufs = *((void **) addr);
+  } else {
+    addr = page->bump;
+    page->bump += kbufsizes[i];
   }
-
-  return NULL;
+  page->pageallocs = page->pageallocs + 1;
+  if (page->pageallocs == page->nbufs) {
+    unlinkpage(page);
+  }
+  return addr;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  freelist_t* list = (freelist_t *)(pages->ptr + sizeof(page_t));
-  ptr = (ptr - sizeof(int));
-  int mysize = *((int *) ptr);
-  // just add this ptr back to the free list
-  // and adjust alloc counts
-  addtofreelist(ptr, mysize);
-  list->allocs--; 
-  page_t* page = (page_t*)(BASEADDR(ptr));
-  page->pageallocs = page->pageallocs - 1;
-  // free all pages or a single page based on the alloc counts
-  if (list->allocs <= 0) {
-    freekpages();
-  } else if (page->pageallocs == 0) {
-    freeonepage(page);
+  if (size > PAGESIZE / 2) {
+    free_pages(kpage_of(ptr));
+    return;
   }
-}
+  page_t* page = PAGEOF(ptr);
+  // the buffer came from the size's class or, if that was empty, one of
+  // the MAXBORROW above it
+  assert(classof(size) <= page->cls
+         && page->cls <= classof(size) + MAXBORROW);
+  bool wasfull = (page->pageallocs == page->nbufs);
+  // put the buffer back on its page's free list
+  *((void **) ptr) = page->freebufs;
+  page->freebufs = ptr;
+  page->pageallocs = page->pageallocs - 1;
 
-void
-freekpages()
-{
-  // free every page left in the list
-  page_t* p = pages->ptr;
-  page_t* next_p;
-  while (p != NULL) {
-    next_p = p->nextpage;
-    free_page(p->me);
-    p = next_p;
+  if (page->pageallocs == 0) {
+    // all back: release the run
+    if (!wasfull) {
+      unlinkpage(page);
+    }
+    free_pages(kpage_of(page));
+  } else if (wasfull) {
+    pushpage(page, TRUE);
+  } else if (page->nbufs - page->pageallocs == page->nbufs / 2 + 1) {
+    // just went past half free
+    unlinkpage(page);
+    pushpage(page, FALSE);
   }
-  pages = NULL;
 }
 
-void* 
-allocintofreelist(kma_size_t size)
+void
+initializeclasses()
 {
-  // given a size, find an appropriate buffer in the free list
-  // and return it (or NULL if there isn't one)
-  freelist_t* list = (freelist_t*)(pages->ptr + sizeof(page_t));
   int i;
-  for (i = 0; i < 10; i ++) {
-    if (list->bufsizes[i] >= size) {
-      if (list->lists[i] != NULL) {
-	void* addr = list->lists[i];
-	void* nextaddr = *((void **) addr);
-	list->lists[i] = nextaddr;
- 	*((int *) addr) = size;
-	// adjust the allocation counts up by one...
-	list->allocs++;
-	page_t* page = (page_t*)(BASEADDR(addr));
-	page->pageallocs = page->pageallocs + 1;
-	return addr + sizeof(int);
-      } else {
-	continue;
+  // the sizes up to half a page
+  for (i = 0; i < MAXCLASSES && kbufsizes[i] <= PAGESIZE / 2; i++) {
+    int pages;
+    int bestwaste = PAGESIZE;
+    for (pages = 1; pages <= MAXRUNPAGES; pages++) {
+      int bytes = pages * PAGESIZE;
+      int n = (bytes - sizeof(page_t)) / kbufsizes[i];
+      int waste = bytes - n * kbufsizes[i];
+      // compare waste per page
+      if (waste * list.runpages[i] < bestwaste * pages || pages == 1) {
+        list.runpages[i] = pages;
+        list.runbufs[i] = n;
+        bestwaste = waste;
+      }
+      if (waste * 100 <= bytes * RUNWASTE) {
+        break;
       }
-    } 
+    }
+    list.partial[i].nextpage = list.partial[i].prevpage = &list.partial[i];
   }
-  return NULL;
+  list.nclasses = i;
+  list.nonempty = 0;
+  initialized = TRUE;
 }
 
-void initializepages()
+int
+classof(kma_size_t size)
 {
-  // this allocates the first page
-  // and adds the struct that tracks the free lists
-  kpage_t* new_kpage = get_page();
-  page_t* new_page = (page_t *)(new_kpage->ptr);
-  new_page->me = new_kpage;
-  new_page->nextpage = NULL;
-  pages = new_kpage;
-  // initialize the freelist struct...
-  freelist_t* list = (freelist_t*)((void *)new_page + sizeof(page_t));
-  list->allocs = 0;
-  int i;
-  int size = 16;
-  for(i = 0; i < 10; i ++) {
-    list->bufsizes[i] = size;
-    list->lists[i] = NULL;
-    size *= 2;
-  }
-  list->bufsizes[9] = (8192 - sizeof(page_t));
-  // partition this page into buffers and add to the free list
-  void* nextaddr = (void *)new_page + sizeof(page_t) + sizeof(freelist_t);
-  size = 16;
-  for(i = 0; i < 10; i++) {
-    if ((((unsigned long int)nextaddr + size) - (unsigned long int)new_page) < new_kpage->size) {
-      addtofreelist(nextaddr, size);
-      nextaddr += size;
-      size *= 2;
-    }
-  }
-  size /= 2;
-  while (size >= 16) {
-    while ((((unsigned long int)nextaddr + size) - (unsigned long int)new_page) < new_kpage->size) {
-      addtofreelist(nextaddr, size);
-      nextaddr += size;
-    }
-    size /= 2;
+  // up to 64 bytes, the next multiple of 16
+  if (size <= SMALLMAX) {
+    return size == 0 ? 0 : (size - 1) >> MINORDER;
   }
+  // size - 1 lies in [64 << g, 128 << g): its class is the quarter
+  // step of that range it is in
+  int g = 31 - __builtin_clz(size - 1) - (MINORDER + 2);
+  return SMALLCLASSES + 4 * g + (((size - 1) >> (g + MINORDER)) & 3);
 }
 
-void allocate_new_page(page_size_t s)
+page_t*
+allocate_new_page(int i)
 {
-  // allocate an "as needed" page
-  kpage_t* new_kpage = get_page();
+  kpage_t* new_kpage = get_pages(list.runpages[i]);
   page_t* new_page = (page_t *)(new_kpage->ptr);
-  new_page->me = new_kpage;
-  new_page->nextpage = NULL;
   new_page->pageallocs = 0;
-  page_t* old_page = (page_t *)(pages->ptr);
-  while(old_page->nextpage != NULL)
-    old_page = old_page->nextpage;
-  old_page->nextpage = new_page;
-  // partition into buffers (depending on the needed size)
-  // and add to the free list
-  void* current = new_kpage->ptr + sizeof(page_t);
-  void* max = new_kpage->ptr + new_kpage->size;
-  int size = 16;
-  if (s == NORMAL) {
-    while((current + size) < max) {
-      addtofreelist(current, size);
-      current = current + size;
-      size *= 2;
-    }
-    size /= 2;
-  } else if (s == BIG) {
-    size = 4096;
-  } else if (s == HUGE) {
-    size = (8192 - sizeof(page_t));
-  }
-  while (size >= 16) {
-    while ((current + size) <= max) {
-      addtofreelist(current, size);
-      current += size;
-    }
-    size /= 2;
+  new_page->cls = i;
+  new_page->nbufs = list.runbufs[i];
+  new_page->freebufs = NULL;
+  // the buffers end where the run does
+  new_page->bump = new_kpage->ptr + new_kpage->size
+    - new_page->nbufs * kbufsizes[i];
+  void* current;
+  for (current = new_kpage->ptr; current < new_kpage->ptr + new_kpage->size;
+       current += PAGESIZE) {
+    kpage_of(current)->priv = new_page;
   }
+  pushpage(new_page, FALSE);
+  return new_page;
 }
 
-void 
-freeonepage(page_t* page)
+void
+pushpage(page_t* page, bool front)
 {
-  // frees a page once its allocation count
-  // has reached 0
-
-  // but don't free the first page!
-  if (((page_t*)pages->ptr) == page)
-    return;
-  
-  kpage_t* kpage = page->me;
-  void* addr = (void*)page;
-  // go through the free lists and remove any buffers
-  // pointing into this page
-  freelist_t* list = (freelist_t*)(pages->ptr + sizeof(page_t));
-  int i;
-  for (i = 0; i < 10; i++) {
-    void** freebuf = ((void**)list->lists) + i;
-    while (*freebuf != NULL) {
-      void* nextbuf = *freebuf;
-      if (BASEADDR(*freebuf) == addr) {
-	*freebuf = *((void**)nextbuf);
-      } else {
-	freebuf = (void**)(*freebuf);
-      }
-    }
+  page_t* head = &list.partial[page->cls];
+  if (front) {
+    page->prevpage = head;
+    page->nextpage = head->nextpage;
+  } else {
+    page->nextpage = head;
+    page->prevpage = head->prevpage;
   }
-  // remove this page from the pages list
-  page_t* pgs = (page_t*)pages->ptr;
-  while (pgs != NULL) {
-    if (pgs->nextpage == page) {
-      pgs->nextpage = page->nextpage;
-      break;
-    }
-    pgs = pgs->nextpage;
-  }
-  // and finally free the page
-  free_page(kpage);
+  page->nextpage->prevpage = page;
+  page->prevpage->nextpage = page;
+  list.nonempty |= 1UL << page->cls;
 }
 
-void addtofreelist(void* addr, int size) 
+void
+unlinkpage(page_t* page)
 {
-  // find the appropriate free list, and
-  // and addr to the beginning of the list
-  freelist_t* list = (freelist_t*)(pages->ptr + sizeof(page_t));
-  int i;
-  for (i = 0; i < 10; i ++) {
-    if (size == list->bufsizes[i]) {
-      *((void **)addr) = list->lists[i];
-      list->lists[i] = addr;
-      break;
-    }
+  page->prevpage->nextpage = page->nextpage;
+  page->nextpage->prevpage = page->prevpage;
+  if (list.partial[page->cls].nextpage == &list.partial[page->cls]) {
+    list.nonempty &= ~(1UL << page->cls);
   }
 }
 
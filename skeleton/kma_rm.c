@@ -41,6 +41,7 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kpage.h"
@@ -53,10 +54,74 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// The map is made of extents ("chunks") carved out of page runs. Every
+// chunk starts with a header; free chunks also repeat their size in the
+// last word (boundary tag), so freeing coalesces with both neighbours in
+// O(1). Free chunks are indexed by a treap kept in the free chunks
+// themselves: by address (augmented with the subtree's largest chunk)
+// for first and next fit, by size for best fit. Each run ends with an
+// in-use sentinel header, so chunks never coalesce across runs and a run
+// whose chunks all merge back is returned with free_pages().
+
+typedef struct chunk
+{
+  int size;            // bytes, header included, multiple of 8
+  int flags;           // INUSE, PREVINUSE
+  struct chunk* left;  // free chunks only: index links
+  struct chunk* right;
+  long max;            // largest chunk size in this subtree
+} chunk_t;
+
+#define INUSE     1
+#define PREVINUSE 2
+
+#define HDRSIZE   8
+#define MINCHUNK  (sizeof(chunk_t) + sizeof(long))
+
+#define NEXTCHUNK(c) ((chunk_t*)((void*)(c) + (c)->size))
+#define FOOTER(c)    (*(long*)((void*)(c) + (c)->size - sizeof(long)))
+
+typedef enum
+{
+  FIRST_FIT,
+  NEXT_FIT,
+  BEST_FIT
+} fit_t;
+
 /************Global Variables*********************************************/
 
+// root of the free chunk index
+static chunk_t* freemap = NULL;
+
+// KMA_RM_FIT=first|next|best, read on the first allocation
+static fit_t fit = BEST_FIT;
+static bool fit_read = FALSE;
+
+// next fit resumes its search here
+static void* rover = NULL;
+
 /************Function Prototypes******************************************/
 
+// get a run of pages big enough for a chunk of the given size
+chunk_t* new_run(int);
+
+// release a free chunk's run if the chunk now covers all of it
+bool release_run(chunk_t*);
+
+// index operations
+void map_insert(chunk_t**, chunk_t*);
+void map_remove(chunk_t**, chunk_t*);
+chunk_t* map_first(chunk_t*, int);
+chunk_t* map_next(chunk_t*, void*, int);
+chunk_t* map_best(chunk_t*, int);
+
+// treap helpers
+bool map_before(chunk_t*, chunk_t*);
+unsigned long map_prio(chunk_t*);
+void map_update(chunk_t*);
+void rotate_left(chunk_t**);
+void rotate_right(chunk_t**);
+
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -64,13 +129,284 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  chunk_t* c;
+  int need = (size + HDRSIZE + 7) & ~7;
+  
+  if (!fit_read) {
+    char* env = getenv("KMA_RM_FIT");
+    if (env != NULL && strcmp(env, "first") == 0)
+      fit = FIRST_FIT;
+    else if (env != NULL && strcmp(env, "next") == 0)
+      fit = NEXT_FIT;
+    fit_read = TRUE;
+  }
+  
+  if (need < MINCHUNK)
+    need = MINCHUNK;
+  
+  switch (fit) {
+  case FIRST_FIT:
+    c = map_first(freemap, need);
+    break;
+  case NEXT_FIT:
+    c = map_next(freemap, rover, need);
+    if (c == NULL)
+      c = map_first(freemap, need);
+    break;
+  default:
+    c = map_best(freemap, need);
+    break;
+  }
+  
+  if (c == NULL) {
+    c = new_run(need);
+  } else {
+    map_remove(&freemap, c);
+  }
+  
+  // split off the tail if it can hold a free chunk of its own
+  if (c->size - need >= MINCHUNK) {
+    chunk_t* rest = (chunk_t*)((void*)c + need);
+    rest->size = c->size - need;
+    rest->flags = PREVINUSE;
+    FOOTER(rest) = rest->size;
+    c->size = need;
+    map_insert(&freemap, rest);
+  } else {
+    NEXTCHUNK(c)->flags |= PREVINUSE;
+  }
+  c->flags |= INUSE;
+  rover = NEXTCHUNK(c);
+  
+  return (void*)c + HDRSIZE;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  chunk_t* c = (chunk_t*)(ptr - HDRSIZE);
+  chunk_t* next = NEXTCHUNK(c);
+  
+  assert(c->flags & INUSE);
+  c->flags &= ~INUSE;
+  
+  // merge with the following extent...
+  if (!(next->flags & INUSE)) {
+    map_remove(&freemap, next);
+    c->size += next->size;
+  }
+  // ...and the preceding one
+  if (!(c->flags & PREVINUSE)) {
+    chunk_t* prev = (chunk_t*)((void*)c - *(long*)((void*)c - sizeof(long)));
+    map_remove(&freemap, prev);
+    prev->size += c->size;
+    c = prev;
+  }
+  FOOTER(c) = c->size;
+  NEXTCHUNK(c)->flags &= ~PREVINUSE;
+  
+  if (!release_run(c)) {
+    map_insert(&freemap, c);
+  }
+}
+
+chunk_t*
+new_run(int need)
+{
+  // one page unless the chunk plus the end sentinel needs more
+  kpage_t* run = get_pages((need + HDRSIZE + PAGESIZE - 1) / PAGESIZE);
+  chunk_t* c = (chunk_t*)run->ptr;
+  chunk_t* end;
+  
+  c->size = run->size - HDRSIZE;
+  c->flags = PREVINUSE;
+  FOOTER(c) = c->size;
+  
+  end = NEXTCHUNK(c);
+  end->size = 0;
+  end->flags = INUSE;
+  
+  return c;
+}
+
+bool
+release_run(chunk_t* c)
+{
+  kpage_t* run;
+  
+  // only the first page of a live run has a descriptor pointing at it
+  if (BASEADDR(c) != (void*)c) {
+    return FALSE;
+  }
+  run = kpage_of(c);
+  if (run->ptr != (void*)c || c->size != run->size - HDRSIZE) {
+    return FALSE;
+  }
+  
+  free_pages(run);
+  return TRUE;
+}
+
+bool
+map_before(chunk_t* a, chunk_t* b)
+{
+  // best fit orders by size, then address; the others by address
+  if (fit == BEST_FIT && a->size != b->size)
+    return a->size < b->size;
+  return a < b;
+}
+
+unsigned long
+map_prio(chunk_t* c)
+{
+  // treap priority derived from the address, so it needs no storage
+  return ((unsigned long)c >> 3) * 0x9E3779B97F4A7C15UL;
+}
+
+void
+map_update(chunk_t* c)
+{
+  c->max = c->size;
+  if (c->left != NULL && c->left->max > c->max)
+    c->max = c->left->max;
+  if (c->right != NULL && c->right->max > c->max)
+    c->max = c->right->max;
+}
+
+void
+rotate_left(chunk_t** root)
+{
+  chunk_t* n = *root;
+  chunk_t* r = n->right;
+  
+  n->right = r->left;
+  r->left = n;
+  map_update(n);
+  map_update(r);
+  *root = r;
+}
+
+void
+rotate_right(chunk_t** root)
+{
+  chunk_t* n = *root;
+  chunk_t* l = n->left;
+  
+  n->left = l->right;
+  l->right = n;
+  map_update(n);
+  map_update(l);
+  *root = l;
+}
+
+void
+map_insert(chunk_t** root, chunk_t* c)
+{
+  chunk_t* n = *root;
+  
+  if (n == NULL) {
+    c->left = NULL;
+    c->right = NULL;
+    c->max = c->size;
+    *root = c;
+    return;
+  }
+  
+  if (map_before(c, n)) {
+    map_insert(&n->left, c);
+    if (map_prio(n->left) > map_prio(n)) {
+      rotate_right(root);
+      return;
+    }
+  } else {
+    map_insert(&n->right, c);
+    if (map_prio(n->right) > map_prio(n)) {
+      rotate_left(root);
+      return;
+    }
+  }
+  map_update(n);
+}
+
+void
+map_remove(chunk_t** root, chunk_t* c)
+{
+  chunk_t* n = *root;
+  
+  assert(n != NULL);
+  
+  if (n == c) {
+    // rotate the node down until it has at most one child
+    if (n->left == NULL) {
+      *root = n->right;
+    } else if (n->right == NULL) {
+      *root = n->left;
+    } else if (map_prio(n->left) > map_prio(n->right)) {
+      rotate_right(root);
+      map_remove(&(*root)->right, c);
+      map_update(*root);
+    } else {
+      rotate_left(root);
+      map_remove(&(*root)->left, c);
+      map_update(*root);
+    }
+    return;
+  }
+  
+  if (map_before(c, n))
+    map_remove(&n->left, c);
+  else
+    map_remove(&n->right, c);
+  map_update(n);
+}
+
+chunk_t*
+map_first(chunk_t* n, int need)
+{
+  // lowest address whose chunk is big enough, steered by subtree max
+  while (n != NULL && n->max >= need) {
+    if (n->left != NULL && n->left->max >= need)
+      n = n->left;
+    else if (n->size >= need)
+      return n;
+    else
+      n = n->right;
+  }
+  return NULL;
+}
+
+chunk_t*
+map_next(chunk_t* n, void* from, int need)
+{
+  chunk_t* c;
+  
+  // lowest address at or after from whose chunk is big enough
+  if (n == NULL || n->max < need)
+    return NULL;
+  if ((void*)n < from)
+    return map_next(n->right, from, need);
+  if ((c = map_next(n->left, from, need)) != NULL)
+    return c;
+  if (n->size >= need)
+    return n;
+  return map_first(n->right, need);
+}
+
+chunk_t*
+map_best(chunk_t* n, int need)
+{
+  chunk_t* best = NULL;
+  
+  // smallest big enough chunk; ties go to the lowest address
+  while (n != NULL) {
+    if (n->size >= need) {
+      best = n;
+      n = n->left;
+    } else {
+      n = n->right;
+    }
+  }
+  return best;
 }
 
 #endif // KMA_RM
@@ -0,0 +1,729 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on the slab algorithm, with
+ *             object caches (kma_slab.h)
+ *    File: kma_slab.c
+ ***************************************************************************/
+#ifdef KMA_SLAB
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+#include "kma_slab.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// A cache hands out objects of one size from slabs, runs of pages cut
+// into objects. Each slab starts with its header and a stack of the
+// indices of its free objects; the free objects themselves are never
+// written, so they keep the state the constructor gave them when the
+// slab was made. Every page of a slab points at the slab through its
+// descriptor's priv field. Slabs sit on one of three lists: partial
+// (allocations come from here first), full, and empty. A cache keeps
+// one empty slab while it has objects out, so a free/alloc pair at a
+// slab boundary does not create and destroy a slab each time, and
+// frees the rest; once it has no objects out, it frees them all.
+// Successive slabs start their objects at different offsets ("colours")
+// within the slack the layout leaves, so objects at the same index in
+// different slabs do not compete for the same cache lines.
+//
+// Caches made with kma_cache_create() also get a magazine layer
+// (Bonwick & Adams, 2001). Each thread holds a loaded and a previous
+// magazine per cache, arrays of object pointers, and allocates and
+// frees by popping and pushing them without any lock. Only when both
+// are empty (or full) does it go to the cache's depot, a locked pair of
+// lists of full and empty magazines, to trade one for the other; only
+// when the depot has none does it reach the slab layer. A depot whose
+// lock is often contended hands out bigger magazines from then on.
+// Objects cached in magazines keep their slabs' pages, so the kmalloc
+// caches under kma_malloc(), which must hand every page back once the
+// caller has freed everything, do without. KMA_SLAB_MAGAZINES=0 turns
+// the layer off for every cache.
+
+typedef struct magazine
+{
+  struct magazine* next;    // on a depot list
+  int size;                 // capacity, in rounds
+  int rounds;               // objects held
+  void* objs[];
+} magazine_t;
+
+#define MAGBYTES(n) (sizeof(magazine_t) + (n) * sizeof(void*))
+
+// a thread's magazines for one cache; previous is always empty or full
+typedef struct
+{
+  magazine_t* loaded;
+  magazine_t* previous;
+} cpu_cache_t;
+
+typedef struct slab
+{
+  struct slab* next;        // on its cache's partial, full or empty list
+  struct slab* prev;
+  kma_cache_t* cache;
+  void* objs;               // the first object
+  int inuse;
+  int nfree;                // free indices on the stack
+  unsigned short freelist[];
+} slab_t;
+
+struct kma_cache
+{
+  int size;                 // object size, rounded up to the alignment
+  int align;
+  void (*ctor)(void*);
+  int slabpages;            // pages per slab
+  int perslab;              // objects per slab
+  int colors;               // object offsets available
+  int color_next;
+  slab_t* partial;
+  slab_t* full;
+  slab_t* empty;
+  int nempty;
+  bool dynamic;             // from kma_cache_create()
+  pthread_mutex_t lock;     // the slab lists
+  // magazine layer, if id >= 0: this thread's magazines are
+  // self.cpu[id]
+  int id;
+  int magsize;              // rounds of the magazines made from now on
+  pthread_mutex_t depot_lock;
+  magazine_t* depot_full;
+  magazine_t* depot_empty;
+  int depot_ops;            // depot acquisitions this window...
+  int depot_contention;     // ...and how many of them had to wait
+};
+
+// magazine caches, and per-thread state
+#define MAXMAGCACHES 64
+
+typedef struct thread_state
+{
+  struct thread_state* next;
+  struct thread_state* prev;
+  bool registered;
+  cpu_cache_t cpu[MAXMAGCACHES];
+} thread_state_t;
+
+// empty slabs kept while the cache is in use
+#define EMPTYKEEP 1
+
+// most pages a slab may span, looking for a layout wasting at most
+// 1/WASTEFRACTION of it
+#define MAXSLABPAGES 8
+#define WASTEFRACTION 8
+
+#define ALIGNUP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+// kma_malloc() caches: powers of two, 16 bytes to half of the biggest
+// page; bigger requests get their own page run
+#define MINORDER 4
+#define MAXCLASSES 12
+
+// magazine sizes, 2^k-2 rounds: with its two-word header a magazine
+// then fills its power-of-two kmalloc buffer exactly (128 to 1024 bytes);
+// a depot window of DEPOTWINDOW acquisitions with more than
+// 1/CONTENTIONRATIO of them contended grows the magazines
+#define MINMAGSIZE 14
+#define MAXMAGSIZE 126
+#define DEPOTWINDOW 256
+#define CONTENTIONRATIO 16
+
+/************Global Variables*********************************************/
+
+// the cache kma_cache_create() takes caches from
+static kma_cache_t cache_cache;
+
+static kma_cache_t kmalloc_caches[MAXCLASSES];
+static pthread_once_t caches_once = PTHREAD_ONCE_INIT;
+
+// kpage is not thread safe
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool magazines = TRUE;
+
+// this thread's magazines, the threads that have any, and the caches
+// whose id is in use
+static __thread thread_state_t self;
+static thread_state_t* threads = NULL;
+static kma_cache_t* mag_caches[MAXMAGCACHES];
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+/************Function Prototypes******************************************/
+
+// set up the kmalloc caches and the cache of caches
+void caches_init();
+
+// set a cache up and pick its slab layout
+void cache_init(kma_cache_t*, int, int, void (*)(void*), bool);
+
+// the slab layer, under the cache's lock
+void* slab_alloc(kma_cache_t*);
+void slab_free(kma_cache_t*, void*);
+
+// make a slab for a cache (on its empty list) and take one apart
+slab_t* slab_create(kma_cache_t*);
+void slab_destroy(slab_t*);
+
+// slab list operations
+void slab_push(slab_t**, slab_t*);
+void slab_unlink(slab_t**, slab_t*);
+
+// kpage, under page_lock
+kpage_t* page_get(int);
+void page_put(kpage_t*);
+
+// magazines: make one, and return one's objects to the slab layer
+// before freeing it
+magazine_t* magazine_alloc(int);
+void magazine_flush(kma_cache_t*, magazine_t*);
+
+// lock the depot, counting contention and resizing magazines
+void depot_lock(kma_cache_t*);
+// an empty magazine of the current size from the depot, or NULL; and
+// an empty magazine back to the depot (under its lock)
+magazine_t* depot_get_empty(kma_cache_t*);
+void depot_put_empty(kma_cache_t*, magazine_t*);
+
+// flush a thread's magazines for a cache
+void cpu_flush(kma_cache_t*, cpu_cache_t*);
+
+// make this thread's magazines reachable to kma_cache_destroy() and
+// flush them when it exits
+void thread_register();
+void thread_key_init();
+void thread_exit(void*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  int c;
+
+  if (size > PAGESIZE / 2) {
+    return page_get((size + PAGESIZE - 1) / PAGESIZE)->ptr;
+  }
+
+  pthread_once(&caches_once, caches_init);
+  c = size <= (1 << MINORDER) ? 0 : 32 - __builtin_clz(size - 1) - MINORDER;
+  return kma_cache_alloc(&kmalloc_caches[c]);
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  if (size > PAGESIZE / 2) {
+    page_put(kpage_of(ptr));
+    return;
+  }
+  kma_cache_free(((slab_t*)kpage_of(ptr)->priv)->cache, ptr);
+}
+
+kma_cache_t*
+kma_cache_create(kma_size_t size, kma_size_t align, void (*ctor)(void*))
+{
+  kma_cache_t* cache;
+  int id;
+
+  pthread_once(&caches_once, caches_init);
+  cache = kma_cache_alloc(&cache_cache);
+  cache_init(cache, size, align, ctor, TRUE);
+
+  if (magazines) {
+    pthread_mutex_lock(&threads_lock);
+    for (id = 0; id < MAXMAGCACHES; id++) {
+      if (mag_caches[id] == NULL) {
+        mag_caches[id] = cache;
+        cache->id = id;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&threads_lock);
+  }
+  return cache;
+}
+
+void*
+kma_cache_alloc(kma_cache_t* cache)
+{
+  if (cache->id >= 0) {
+    cpu_cache_t* cpu = &self.cpu[cache->id];
+    magazine_t* m;
+
+    if (cpu->loaded != NULL && cpu->loaded->rounds > 0) {
+      return cpu->loaded->objs[--cpu->loaded->rounds];
+    }
+    if (cpu->previous != NULL && cpu->previous->rounds > 0) {
+      m = cpu->previous;
+      cpu->previous = cpu->loaded;
+      cpu->loaded = m;
+      return m->objs[--m->rounds];
+    }
+
+    // both empty: trade the previous one for a full one
+    if (!self.registered)
+      thread_register();
+    depot_lock(cache);
+    m = cache->depot_full;
+    if (m != NULL) {
+      cache->depot_full = m->next;
+      if (cpu->previous != NULL)
+        depot_put_empty(cache, cpu->previous);
+      cpu->previous = cpu->loaded;
+      cpu->loaded = m;
+    }
+    pthread_mutex_unlock(&cache->depot_lock);
+    if (m != NULL) {
+      return m->objs[--m->rounds];
+    }
+  }
+  return slab_alloc(cache);
+}
+
+void
+kma_cache_free(kma_cache_t* cache, void* obj)
+{
+  assert(((slab_t*)kpage_of(obj)->priv)->cache == cache);
+
+  if (cache->id >= 0) {
+    cpu_cache_t* cpu = &self.cpu[cache->id];
+    magazine_t* m;
+    int magsize;
+
+    if (cpu->loaded != NULL && cpu->loaded->rounds < cpu->loaded->size) {
+      cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+      return;
+    }
+    if (cpu->previous != NULL && cpu->previous->rounds == 0) {
+      m = cpu->previous;
+      cpu->previous = cpu->loaded;
+      cpu->loaded = m;
+      m->objs[m->rounds++] = obj;
+      return;
+    }
+
+    // both full: trade the previous one for an empty one, or make one
+    if (!self.registered)
+      thread_register();
+    depot_lock(cache);
+    m = depot_get_empty(cache);
+    magsize = cache->magsize;
+    if (cpu->previous != NULL) {
+      cpu->previous->next = cache->depot_full;
+      cache->depot_full = cpu->previous;
+    }
+    cpu->previous = cpu->loaded;
+    pthread_mutex_unlock(&cache->depot_lock);
+
+    cpu->loaded = m != NULL ? m : magazine_alloc(magsize);
+    if (cpu->loaded != NULL) {
+      cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+      return;
+    }
+  }
+  slab_free(cache, obj);
+}
+
+void
+kma_cache_reap(kma_cache_t* cache)
+{
+  magazine_t* m;
+  magazine_t* full;
+  magazine_t* empty;
+
+  if (cache->id < 0)
+    return;
+
+  pthread_mutex_lock(&cache->depot_lock);
+  full = cache->depot_full;
+  empty = cache->depot_empty;
+  cache->depot_full = cache->depot_empty = NULL;
+  pthread_mutex_unlock(&cache->depot_lock);
+
+  while ((m = full) != NULL) {
+    full = m->next;
+    magazine_flush(cache, m);
+  }
+  while ((m = empty) != NULL) {
+    empty = m->next;
+    magazine_flush(cache, m);
+  }
+}
+
+void
+kma_cache_destroy(kma_cache_t* cache)
+{
+  if (cache->id >= 0) {
+    thread_state_t* t;
+
+    pthread_mutex_lock(&threads_lock);
+    for (t = threads; t != NULL; t = t->next) {
+      cpu_flush(cache, &t->cpu[cache->id]);
+    }
+    mag_caches[cache->id] = NULL;
+    pthread_mutex_unlock(&threads_lock);
+    kma_cache_reap(cache);
+  }
+
+  assert(cache->partial == NULL && cache->full == NULL);
+
+  while (cache->empty != NULL) {
+    slab_destroy(cache->empty);
+  }
+  pthread_mutex_destroy(&cache->lock);
+  pthread_mutex_destroy(&cache->depot_lock);
+  if (cache->dynamic) {
+    kma_cache_free(&cache_cache, cache);
+  }
+}
+
+void
+caches_init()
+{
+  char* env = getenv("KMA_SLAB_MAGAZINES");
+  int c;
+
+  if (env != NULL && strcmp(env, "0") == 0) {
+    magazines = FALSE;
+  }
+
+  cache_init(&cache_cache, sizeof(kma_cache_t), 0, NULL, FALSE);
+  for (c = 0; c < MAXCLASSES && (1 << (c + MINORDER)) <= PAGESIZE / 2; c++) {
+    cache_init(&kmalloc_caches[c], 1 << (c + MINORDER), 0, NULL, FALSE);
+  }
+}
+
+void
+cache_init(kma_cache_t* cache, int size, int align, void (*ctor)(void*),
+           bool dynamic)
+{
+  int pages;
+  int best = 0;
+
+  if (align == 0)
+    align = sizeof(void*);
+  assert((align & (align - 1)) == 0);
+
+  cache->size = ALIGNUP(size > 0 ? size : 1, align);
+  cache->align = align;
+  cache->ctor = ctor;
+  cache->color_next = 0;
+  cache->partial = cache->full = cache->empty = NULL;
+  cache->nempty = 0;
+  cache->dynamic = dynamic;
+  pthread_mutex_init(&cache->lock, NULL);
+
+  // kma_cache_create() hands out an id if the cache gets magazines
+  cache->id = -1;
+  cache->magsize = MINMAGSIZE;
+  pthread_mutex_init(&cache->depot_lock, NULL);
+  cache->depot_full = cache->depot_empty = NULL;
+  cache->depot_ops = cache->depot_contention = 0;
+
+  // the fewest pages that waste little enough; failing that, the
+  // layout wasting the smallest share
+  for (pages = 1; pages <= MAXSLABPAGES; pages++) {
+    int bytes = pages * PAGESIZE;
+    int n = (bytes - sizeof(slab_t)) / (cache->size + sizeof(unsigned short));
+    int waste;
+
+    while (n > 0 && ALIGNUP(sizeof(slab_t) + n * sizeof(unsigned short), align)
+           + n * cache->size > bytes) {
+      n--;
+    }
+    if (n == 0)
+      continue;
+    waste = bytes - ALIGNUP(sizeof(slab_t) + n * sizeof(unsigned short), align)
+      - n * cache->size;
+    if (best == 0 || waste * cache->slabpages < cache->colors * pages) {
+      // colors holds the best layout's waste until the loop ends
+      best = pages;
+      cache->slabpages = pages;
+      cache->perslab = n;
+      cache->colors = waste;
+    }
+    if (waste * WASTEFRACTION <= bytes)
+      break;
+  }
+  assert(best > 0);
+  cache->colors = cache->colors / align + 1;
+}
+
+void*
+slab_alloc(kma_cache_t* cache)
+{
+  slab_t* slab;
+  void* obj;
+
+  pthread_mutex_lock(&cache->lock);
+  slab = cache->partial;
+  if (slab == NULL) {
+    slab = cache->empty != NULL ? cache->empty : slab_create(cache);
+    slab_unlink(&cache->empty, slab);
+    cache->nempty--;
+    slab_push(&cache->partial, slab);
+  }
+
+  obj = slab->objs + slab->freelist[--slab->nfree] * cache->size;
+  slab->inuse++;
+
+  if (slab->nfree == 0) {
+    slab_unlink(&cache->partial, slab);
+    slab_push(&cache->full, slab);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return obj;
+}
+
+void
+slab_free(kma_cache_t* cache, void* obj)
+{
+  slab_t* slab = kpage_of(obj)->priv;
+
+  pthread_mutex_lock(&cache->lock);
+  slab->freelist[slab->nfree++] = (obj - slab->objs) / cache->size;
+  slab->inuse--;
+
+  if (slab->nfree == 1) {
+    slab_unlink(&cache->full, slab);
+    slab_push(&cache->partial, slab);
+  }
+  if (slab->inuse == 0) {
+    slab_unlink(&cache->partial, slab);
+    slab_push(&cache->empty, slab);
+    cache->nempty++;
+
+    // reclaim
+    while (cache->empty != NULL
+           && (cache->nempty > EMPTYKEEP
+               || (cache->partial == NULL && cache->full == NULL))) {
+      slab_destroy(cache->empty);
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+slab_t*
+slab_create(kma_cache_t* cache)
+{
+  kpage_t* run = page_get(cache->slabpages);
+  slab_t* slab = run->ptr;
+  int hdr = ALIGNUP(sizeof(slab_t) + cache->perslab * sizeof(unsigned short),
+                    cache->align);
+  void* page;
+  int i;
+
+  for (page = run->ptr; page < run->ptr + run->size; page += PAGESIZE) {
+    kpage_of(page)->priv = slab;
+  }
+
+  slab->cache = cache;
+  slab->objs = run->ptr + hdr + cache->color_next * cache->align;
+  cache->color_next = (cache->color_next + 1) % cache->colors;
+  slab->inuse = 0;
+  slab->nfree = cache->perslab;
+
+  // hand out the lowest addresses first
+  for (i = 0; i < cache->perslab; i++) {
+    slab->freelist[i] = cache->perslab - 1 - i;
+  }
+  if (cache->ctor != NULL) {
+    for (i = 0; i < cache->perslab; i++) {
+      cache->ctor(slab->objs + i * cache->size);
+    }
+  }
+
+  slab_push(&cache->empty, slab);
+  cache->nempty++;
+  return slab;
+}
+
+void
+slab_destroy(slab_t* slab)
+{
+  kma_cache_t* cache = slab->cache;
+
+  assert(slab->inuse == 0);
+  slab_unlink(&cache->empty, slab);
+  cache->nempty--;
+  page_put(kpage_of(slab));
+}
+
+void
+slab_push(slab_t** list, slab_t* slab)
+{
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+void
+slab_unlink(slab_t** list, slab_t* slab)
+{
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+}
+
+kpage_t*
+page_get(int n)
+{
+  kpage_t* run;
+
+  pthread_mutex_lock(&page_lock);
+  run = get_pages(n);
+  pthread_mutex_unlock(&page_lock);
+  return run;
+}
+
+void
+page_put(kpage_t* run)
+{
+  pthread_mutex_lock(&page_lock);
+  free_pages(run);
+  pthread_mutex_unlock(&page_lock);
+}
+
+magazine_t*
+magazine_alloc(int size)
+{
+  magazine_t* m = kma_malloc(MAGBYTES(size));
+
+  if (m != NULL) {
+    m->size = size;
+    m->rounds = 0;
+  }
+  return m;
+}
+
+void
+magazine_flush(kma_cache_t* cache, magazine_t* m)
+{
+  while (m->rounds > 0) {
+    slab_free(cache, m->objs[--m->rounds]);
+  }
+  kma_free(m, MAGBYTES(m->size));
+}
+
+void
+depot_lock(kma_cache_t* cache)
+{
+  if (pthread_mutex_trylock(&cache->depot_lock) != 0) {
+    pthread_mutex_lock(&cache->depot_lock);
+    cache->depot_contention++;
+  }
+
+  if (++cache->depot_ops < DEPOTWINDOW)
+    return;
+  if (cache->depot_contention * CONTENTIONRATIO > cache->depot_ops
+      && cache->magsize < MAXMAGSIZE) {
+    magazine_t* m;
+
+    // the empty magazines are too small now
+    cache->magsize = cache->magsize * 2 + 2;
+    while ((m = cache->depot_empty) != NULL) {
+      cache->depot_empty = m->next;
+      kma_free(m, MAGBYTES(m->size));
+    }
+  }
+  cache->depot_ops = cache->depot_contention = 0;
+}
+
+magazine_t*
+depot_get_empty(kma_cache_t* cache)
+{
+  magazine_t* m = cache->depot_empty;
+
+  if (m != NULL)
+    cache->depot_empty = m->next;
+  return m;
+}
+
+void
+depot_put_empty(kma_cache_t* cache, magazine_t* m)
+{
+  if (m->size != cache->magsize) {
+    kma_free(m, MAGBYTES(m->size));
+    return;
+  }
+  m->next = cache->depot_empty;
+  cache->depot_empty = m;
+}
+
+void
+cpu_flush(kma_cache_t* cache, cpu_cache_t* cpu)
+{
+  if (cpu->loaded != NULL)
+    magazine_flush(cache, cpu->loaded);
+  if (cpu->previous != NULL)
+    magazine_flush(cache, cpu->previous);
+  cpu->loaded = cpu->previous = NULL;
+}
+
+void
+thread_register()
+{
+  pthread_once(&thread_once, thread_key_init);
+
+  pthread_mutex_lock(&threads_lock);
+  self.prev = NULL;
+  self.next = threads;
+  if (threads != NULL)
+    threads->prev = &self;
+  threads = &self;
+  pthread_mutex_unlock(&threads_lock);
+
+  pthread_setspecific(thread_key, &self);
+  self.registered = TRUE;
+}
+
+void
+thread_key_init()
+{
+  pthread_key_create(&thread_key, thread_exit);
+}
+
+void
+thread_exit(void* arg)
+{
+  thread_state_t* t = arg;
+  int id;
+
+  pthread_mutex_lock(&threads_lock);
+  for (id = 0; id < MAXMAGCACHES; id++) {
+    if (mag_caches[id] != NULL)
+      cpu_flush(mag_caches[id], &t->cpu[id]);
+  }
+  if (t->next != NULL)
+    t->next->prev = t->prev;
+  if (t->prev != NULL)
+    t->prev->next = t->next;
+  else
+    threads = t->next;
+  pthread_mutex_unlock(&threads_lock);
+}
+
+#endif // KMA_SLAB
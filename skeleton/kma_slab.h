@@ -0,0 +1,96 @@
+/***************************************************************************
+ *  Title: Slab Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Object cache interface of the slab allocator (KMA_SLAB)
+ *    File: kma_slab.h
+ ***************************************************************************/
+
+#ifndef __KMA_SLAB_H__
+#define __KMA_SLAB_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KMA_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+// an object cache; its layout is private to kma_slab.c
+typedef struct kma_cache kma_cache_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Creates an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Creates a cache of objects of one size. The constructor,
+ *             if any, runs once for each object when its slab is
+ *             created, not on every allocation: objects must be freed
+ *             back in their constructed state
+ *    Input: the object size, the alignment (a power of two, or 0 for
+ *           pointer alignment), the constructor or NULL
+ *    Output: the cache
+ ***********************************************************************/
+EXTERN kma_cache_t* kma_cache_create(kma_size_t size, kma_size_t align,
+                                     void (*ctor)(void*));
+
+/***********************************************************************
+ *  Title: Allocates an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Takes a constructed object from a cache
+ *    Input: the cache
+ *    Output: the object
+ ***********************************************************************/
+EXTERN void* kma_cache_alloc(kma_cache_t* cache);
+
+/***********************************************************************
+ *  Title: Frees an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Returns an object, in its constructed state, to the
+ *             cache it came from
+ *    Input: the cache, the object
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_cache_free(kma_cache_t* cache, void* obj);
+
+/***********************************************************************
+ *  Title: Reaps an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Returns the objects held in the cache's depot of
+ *             magazines to its slabs, so their pages can be freed.
+ *             Threads keep the magazines they have loaded
+ *    Input: the cache
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_cache_reap(kma_cache_t* cache);
+
+/***********************************************************************
+ *  Title: Destroys an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a cache whose objects have all been freed,
+ *             along with its slabs and every thread's magazines. No
+ *             other thread may be using the cache
+ *    Input: the cache
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_cache_destroy(kma_cache_t* cache);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMA_SLAB_H__ */
@@ -0,0 +1,270 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on the Two-Level Segregated
+ *             Fit (TLSF) algorithm
+ *    File: kma_tlsf.c
+ ***************************************************************************/
+#ifdef KMA_TLSF
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// Free chunks are segregated by size in two levels: the first level is
+// the power of two below the size, the second splits that range into
+// SLCOUNT equal parts. A bitmap per level says which lists are
+// non-empty, so finding a list with a chunk that is big enough is two
+// find-first-set operations, and malloc and free do a bounded amount of
+// work whatever the heap looks like. Chunks are carved from page spans
+// and use the same boundary tags as kma_rm (8 byte header, size
+// repeated at the end of free chunks), so a free merges with both
+// neighbours at once. A span ends in an in-use sentinel and is returned
+// to kpage as soon as it is one free chunk again.
+
+typedef struct chunk
+{
+  int size;            // bytes, header included, multiple of 8
+  int flags;           // INUSE, PREVINUSE
+  struct chunk* next;  // free chunks only: segregated list links
+  struct chunk* prev;
+} chunk_t;
+
+#define INUSE     1
+#define PREVINUSE 2
+
+#define HDRSIZE   8
+#define MINCHUNK  (sizeof(chunk_t) + sizeof(long))
+
+#define NEXTCHUNK(c) ((chunk_t*)((void*)(c) + (c)->size))
+#define FOOTER(c)    (*(long*)((void*)(c) + (c)->size - sizeof(long)))
+
+// 16 second level lists; sizes below SMALLCHUNK all share the first
+// first level list, split linearly in steps of 8 bytes
+#define SLLOG2     4
+#define SLCOUNT    (1 << SLLOG2)
+#define FLSHIFT    (SLLOG2 + 3)
+#define SMALLCHUNK (1 << FLSHIFT)
+#define FLCOUNT    (31 - FLSHIFT + 1)
+
+/************Global Variables*********************************************/
+
+static unsigned int flbitmap = 0;
+static unsigned int slbitmap[FLCOUNT];
+static chunk_t* lists[FLCOUNT][SLCOUNT];
+
+/************Function Prototypes******************************************/
+
+// list indices of a chunk size; the search variant rounds up so every
+// chunk in the list found is big enough
+void mapping_insert(int, int*, int*);
+void mapping_search(int, int*, int*);
+
+// a non-empty list at or above the indices, or NULL
+chunk_t* find_suitable(int*, int*);
+
+// list operations
+void insert_chunk(chunk_t*);
+void remove_chunk(chunk_t*);
+
+// get a span of pages big enough for a chunk of the given size
+chunk_t* new_span(int);
+
+// release a free chunk's span if the chunk now covers all of it
+bool release_span(chunk_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  int need = (size + HDRSIZE + 7) & ~7;
+  int fl, sl;
+  chunk_t* c;
+
+  if (need < MINCHUNK)
+    need = MINCHUNK;
+
+  mapping_search(need, &fl, &sl);
+  c = find_suitable(&fl, &sl);
+
+  if (c == NULL) {
+    c = new_span(need);
+  } else {
+    remove_chunk(c);
+  }
+
+  // split off the tail if it can hold a free chunk of its own
+  if (c->size - need >= MINCHUNK) {
+    chunk_t* rest = (chunk_t*)((void*)c + need);
+    rest->size = c->size - need;
+    rest->flags = PREVINUSE;
+    FOOTER(rest) = rest->size;
+    c->size = need;
+    insert_chunk(rest);
+  } else {
+    NEXTCHUNK(c)->flags |= PREVINUSE;
+  }
+  c->flags |= INUSE;
+
+  return (void*)c + HDRSIZE;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  chunk_t* c = (chunk_t*)(ptr - HDRSIZE);
+  chunk_t* next = NEXTCHUNK(c);
+
+  assert(c->flags & INUSE);
+  c->flags &= ~INUSE;
+
+  // merge with the following chunk...
+  if (!(next->flags & INUSE)) {
+    remove_chunk(next);
+    c->size += next->size;
+  }
+  // ...and the preceding one
+  if (!(c->flags & PREVINUSE)) {
+    chunk_t* prev = (chunk_t*)((void*)c - *(long*)((void*)c - sizeof(long)));
+    remove_chunk(prev);
+    prev->size += c->size;
+    c = prev;
+  }
+  FOOTER(c) = c->size;
+  NEXTCHUNK(c)->flags &= ~PREVINUSE;
+
+  if (!release_span(c)) {
+    insert_chunk(c);
+  }
+}
+
+void
+mapping_insert(int size, int* fl, int* sl)
+{
+  if (size < SMALLCHUNK) {
+    *fl = 0;
+    *sl = size / (SMALLCHUNK / SLCOUNT);
+  } else {
+    int msb = 31 - __builtin_clz(size);
+    *sl = (size >> (msb - SLLOG2)) ^ SLCOUNT;
+    *fl = msb - FLSHIFT + 1;
+  }
+}
+
+void
+mapping_search(int size, int* fl, int* sl)
+{
+  if (size >= SMALLCHUNK) {
+    int msb = 31 - __builtin_clz(size);
+    size += (1 << (msb - SLLOG2)) - 1;
+  }
+  mapping_insert(size, fl, sl);
+}
+
+chunk_t*
+find_suitable(int* fl, int* sl)
+{
+  unsigned int slmap = slbitmap[*fl] & (~0U << *sl);
+
+  if (slmap == 0) {
+    // nothing big enough at this level: the next non-empty one up
+    unsigned int flmap = flbitmap & (~0U << (*fl + 1));
+    if (flmap == 0)
+      return NULL;
+    *fl = __builtin_ctz(flmap);
+    slmap = slbitmap[*fl];
+  }
+  *sl = __builtin_ctz(slmap);
+  return lists[*fl][*sl];
+}
+
+void
+insert_chunk(chunk_t* c)
+{
+  int fl, sl;
+
+  mapping_insert(c->size, &fl, &sl);
+  c->prev = NULL;
+  c->next = lists[fl][sl];
+  if (c->next != NULL)
+    c->next->prev = c;
+  lists[fl][sl] = c;
+  flbitmap |= 1U << fl;
+  slbitmap[fl] |= 1U << sl;
+}
+
+void
+remove_chunk(chunk_t* c)
+{
+  int fl, sl;
+
+  if (c->next != NULL)
+    c->next->prev = c->prev;
+  if (c->prev != NULL) {
+    c->prev->next = c->next;
+    return;
+  }
+
+  // first on its list
+  mapping_insert(c->size, &fl, &sl);
+  lists[fl][sl] = c->next;
+  if (c->next == NULL) {
+    slbitmap[fl] &= ~(1U << sl);
+    if (slbitmap[fl] == 0)
+      flbitmap &= ~(1U << fl);
+  }
+}
+
+chunk_t*
+new_span(int need)
+{
+  // one page unless the chunk plus the end sentinel needs more
+  kpage_t* span = get_pages((need + HDRSIZE + PAGESIZE - 1) / PAGESIZE);
+  chunk_t* c = (chunk_t*)span->ptr;
+  chunk_t* end;
+
+  c->size = span->size - HDRSIZE;
+  c->flags = PREVINUSE;
+  FOOTER(c) = c->size;
+
+  end = NEXTCHUNK(c);
+  end->size = 0;
+  end->flags = INUSE;
+
+  return c;
+}
+
+bool
+release_span(chunk_t* c)
+{
+  kpage_t* span;
+
+  // only the first page of a live span has a descriptor pointing at it
+  if (BASEADDR(c) != (void*)c) {
+    return FALSE;
+  }
+  span = kpage_of(c);
+  if (span->ptr != (void*)c || c->size != span->size - HDRSIZE) {
+    return FALSE;
+  }
+
+  free_pages(span);
+  return TRUE;
+}
+
+#endif // KMA_TLSF
@@ -0,0 +1,501 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on the weighted buddy
+ *             algorithm (2^k and 3*2^k buffers)
+ *    File: kma_wbud.c
+ ***************************************************************************/
+#ifdef KMA_WBUD
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// Every page is a buddy tree of 2^k buffers in which any block Q may
+// also be split unevenly, into a 3*2^k buffer (its left half plus the
+// left quarter of its right half) and the remaining quarter. Those are
+// the only shapes, so the buffers a block can merge with are still
+// computed from its offset and size alone:
+//   - its binary buddy, offset ^ size;
+//   - as a left half, its sibling's left half, making a 3*2^k buffer;
+//   - as a third quarter, the left half before it (again 3*2^k);
+//   - as a last quarter, the 3*2^k buffer before it;
+//   - a 3*2^k buffer, the quarter after it.
+// Because a fully free range may now be a piece of a larger 3*2^k
+// buffer, each page keeps two bitmaps, in a slot of a separate metadata
+// page found through the page descriptor's priv field: a bit at the
+// first granule (16 bytes) of every buffer, and an in-use bit there.
+// Buffers carry a 4 byte size header; a page whose buffers all
+// coalesce back is returned to kpage.
+
+#define MINORDER 4
+// 16, 32, 48, 64, 96 .. MAXPAGESIZE
+#define MAXCLASSES 24
+
+// a free buffer, linked both ways so a buddy can be unlinked in O(1)
+typedef struct block
+{
+  struct block* next;
+  struct block* prev;
+} block_t;
+
+typedef struct
+{
+  int nclasses;
+  int bufsizes[MAXCLASSES];
+  block_t* lists[MAXCLASSES];
+} freelist_t;
+
+#define BITMAPWORDS (PAGESIZE / 16 / 64)
+
+// metadata of one page
+typedef struct
+{
+  unsigned long* heads;  // first granule of every buffer
+  unsigned long* used;   // set at the first granule of buffers in use
+} pagemeta_t;
+
+#define SLOTSIZE (sizeof(pagemeta_t) + 2 * BITMAPWORDS * sizeof(unsigned long))
+
+// a metadata page is this header followed by SLOTSIZE slots
+typedef struct metapage
+{
+  struct metapage* next;  // metadata pages with free slots
+  struct metapage* prev;
+  int used;               // slots handed out
+  void* freeslots;
+} metapage_t;
+
+#define META(page) ((pagemeta_t*)kpage_of(page)->priv)
+
+#define WORDBITS (8 * sizeof(unsigned long))
+
+#define ISPOW2(x) (((x) & ((x) - 1)) == 0)
+
+/************Global Variables*********************************************/
+static freelist_t freelist;
+static bool initialized = FALSE;
+
+// metadata pages with free slots
+static metapage_t* metapages = NULL;
+
+/************Function Prototypes******************************************/
+// set the buffer sizes up
+void initializeclasses();
+
+// class of a buffer size, and the smallest class holding a size
+int class_of(int);
+int class_for(int);
+
+// take a buffer of a class, splitting a bigger one if needed
+void* get_free_block(int);
+
+// merge a free buffer with its neighbours and put it back
+void release_block(void*, int);
+
+// free list operations
+void addtofreelist(void*, int);
+void removefromfreelist(void*, int);
+
+// is there a free buffer of exactly this offset and size
+bool block_free(pagemeta_t*, void*, int, int);
+
+// get a page and put it on the free lists; return one fully coalesced
+void allocate_new_page();
+void free_one_page(void*);
+
+// get and release a page metadata slot
+pagemeta_t* get_meta();
+void put_meta(pagemeta_t*);
+
+// bit operations
+bool test_bit(unsigned long[], int);
+void set_bit(unsigned long[], int, bool);
+int count_range(unsigned long[], int, int);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  if (size + sizeof(int) > PAGESIZE) {
+    // large objects get their own run of pages
+    return get_pages((size + PAGESIZE - 1) / PAGESIZE)->ptr;
+  }
+
+  if (!initialized) {
+    initializeclasses();
+  }
+
+  int c = class_for(size + sizeof(int));
+  void* addr = get_free_block(c);
+
+  *((int*)addr) = freelist.bufsizes[c];
+  return addr + sizeof(int);
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  if (size + sizeof(int) > PAGESIZE) {
+    free_pages(kpage_of(ptr));
+    return;
+  }
+
+  ptr = ptr - sizeof(int);
+  int mysize = *((int*)ptr); // size INCLUDES header
+  pagemeta_t* meta = META(ptr);
+
+  set_bit(meta->used, (ptr - BASEADDR(ptr)) / 16, FALSE);
+  release_block(ptr, mysize);
+}
+
+void
+initializeclasses()
+{
+  int i = 0;
+  int size;
+
+  // 2^k, with 3*2^k between each pair from 32 up
+  for (size = 1 << MINORDER; size <= PAGESIZE; size *= 2) {
+    if (size >= 4 << MINORDER) {
+      freelist.bufsizes[i] = 3 * size / 4;
+      freelist.lists[i++] = NULL;
+    }
+    freelist.bufsizes[i] = size;
+    freelist.lists[i++] = NULL;
+  }
+  freelist.nclasses = i;
+  initialized = TRUE;
+}
+
+int
+class_of(int size)
+{
+  int k = __builtin_ctz(size);
+
+  // 2^k and 3*2^k buffers interleave: 16, 32, 48, 64, 96, ...
+  if (ISPOW2(size)) {
+    return k == MINORDER ? 0 : 2 * (k - MINORDER) - 1;
+  }
+  return 2 * (k - MINORDER) + 2;
+}
+
+int
+class_for(int size)
+{
+  int pow2 = 1 << MINORDER;
+
+  while (pow2 < size) {
+    pow2 *= 2;
+  }
+  if (pow2 >= 4 << MINORDER && size <= 3 * pow2 / 4) {
+    return class_of(3 * pow2 / 4);
+  }
+  return class_of(pow2);
+}
+
+void*
+get_free_block(int c)
+{
+  int i = c;
+  int target = freelist.bufsizes[c];
+
+  while (i < freelist.nclasses && freelist.lists[i] == NULL) {
+    i++;
+  }
+  if (i == freelist.nclasses) {
+    allocate_new_page();
+    i = freelist.nclasses - 1;
+  }
+
+  void* addr = freelist.lists[i];
+  int size = freelist.bufsizes[i];
+  pagemeta_t* meta = META(addr);
+  void* page = BASEADDR(addr);
+
+  removefromfreelist(addr, size);
+
+  // split down to the class, freeing the piece not kept each time
+  while (size != target) {
+    void* rest;
+    int restsize;
+
+    if (ISPOW2(size)) {
+      if (target > size / 2) {
+        // target is 3*size/4: keep that, free the last quarter
+        restsize = size / 4;
+        rest = addr + 3 * restsize;
+        size = 3 * restsize;
+      } else {
+        restsize = size / 2;
+        rest = addr + restsize;
+        size = restsize;
+      }
+    } else {
+      int quarter = size / 3;
+
+      if (target > quarter) {
+        // keep the left half, free the third quarter
+        restsize = quarter;
+        rest = addr + 2 * quarter;
+        size = 2 * quarter;
+      } else {
+        // keep the third quarter, free the (bigger) left half
+        restsize = 2 * quarter;
+        rest = addr;
+        addr = addr + 2 * quarter;
+        size = quarter;
+      }
+    }
+    set_bit(meta->heads, (rest - page) / 16, TRUE);
+    set_bit(meta->heads, (addr - page) / 16, TRUE);
+    addtofreelist(rest, restsize);
+  }
+
+  set_bit(meta->used, (addr - page) / 16, TRUE);
+  return addr;
+}
+
+void
+release_block(void* ptr, int size)
+{
+  void* page = BASEADDR(ptr);
+  pagemeta_t* meta = META(page);
+  int offset = ptr - page;
+  int merged = TRUE;
+
+  while (size < PAGESIZE && merged) {
+    int s = size;
+    merged = FALSE;
+
+    if (!ISPOW2(size)) {
+      int quarter = size / 3;
+
+      // a 3*2^k buffer only merges with the quarter after it
+      if (block_free(meta, page, offset + size, quarter)) {
+        removefromfreelist(page + offset + size, quarter);
+        set_bit(meta->heads, (offset + size) / 16, FALSE);
+        size += quarter;
+        merged = TRUE;
+      }
+      continue;
+    }
+
+    if (block_free(meta, page, offset ^ s, s)) {
+      // binary buddy
+      removefromfreelist(page + (offset ^ s), s);
+      set_bit(meta->heads, ((offset ^ s) | offset) / 16, FALSE);
+      offset &= ~s;
+      size = 2 * s;
+      merged = TRUE;
+    } else if ((offset / s) % 4 == 3
+               && block_free(meta, page, offset - 3 * s, 3 * s)) {
+      // last quarter, after a free 3*2^k buffer
+      removefromfreelist(page + offset - 3 * s, 3 * s);
+      set_bit(meta->heads, offset / 16, FALSE);
+      offset -= 3 * s;
+      size = 4 * s;
+      merged = TRUE;
+    } else if ((offset & s) == 0 && s / 2 >= (1 << MINORDER)
+               && block_free(meta, page, offset + s, s / 2)) {
+      // left half, before its sibling's free left quarter
+      removefromfreelist(page + offset + s, s / 2);
+      set_bit(meta->heads, (offset + s) / 16, FALSE);
+      size = 3 * s / 2;
+      merged = TRUE;
+    } else if ((offset / s) % 4 == 2
+               && block_free(meta, page, offset - 2 * s, 2 * s)) {
+      // third quarter, after its free left half
+      removefromfreelist(page + offset - 2 * s, 2 * s);
+      set_bit(meta->heads, offset / 16, FALSE);
+      offset -= 2 * s;
+      size = 3 * s;
+      merged = TRUE;
+    }
+  }
+
+  if (size == PAGESIZE) {
+    free_one_page(page);
+  } else {
+    addtofreelist(page + offset, size);
+  }
+}
+
+bool
+block_free(pagemeta_t* meta, void* page, int offset, int size)
+{
+  int bit = offset / 16;
+  int end = (offset + size) / 16;
+
+  // a buffer of its own (a head here and none inside), not in use, and
+  // ending where the next buffer starts
+  return test_bit(meta->heads, bit)
+    && !test_bit(meta->used, bit)
+    && count_range(meta->heads, bit, end - bit) == 1
+    && (offset + size == PAGESIZE || test_bit(meta->heads, end));
+}
+
+void
+addtofreelist(void* addr, int size)
+{
+  int i = class_of(size);
+  block_t* b = (block_t*)addr;
+
+  b->next = freelist.lists[i];
+  b->prev = NULL;
+  if (b->next != NULL)
+    b->next->prev = b;
+  freelist.lists[i] = b;
+}
+
+void
+removefromfreelist(void* addr, int size)
+{
+  block_t* b = (block_t*)addr;
+
+  if (b->next != NULL)
+    b->next->prev = b->prev;
+  if (b->prev != NULL) {
+    b->prev->next = b->next;
+    return;
+  }
+  // first on its list
+  freelist.lists[class_of(size)] = b->next;
+}
+
+void
+allocate_new_page()
+{
+  kpage_t* new_kpage = get_page();
+  pagemeta_t* meta = get_meta();
+
+  memset(meta->heads, 0, BITMAPWORDS * sizeof(unsigned long));
+  memset(meta->used, 0, BITMAPWORDS * sizeof(unsigned long));
+  set_bit(meta->heads, 0, TRUE);
+  new_kpage->priv = meta;
+  addtofreelist(new_kpage->ptr, PAGESIZE);
+}
+
+void
+free_one_page(void* page)
+{
+  kpage_t* kpage = kpage_of(page);
+
+  put_meta(kpage->priv);
+  free_page(kpage);
+}
+
+pagemeta_t*
+get_meta()
+{
+  metapage_t* meta = metapages;
+  pagemeta_t* slot;
+
+  if (meta == NULL) {
+    int i;
+
+    meta = get_page()->ptr;
+    meta->next = meta->prev = NULL;
+    meta->used = 0;
+    meta->freeslots = NULL;
+    for (i = (PAGESIZE - sizeof(metapage_t)) / SLOTSIZE - 1; i >= 0; i--) {
+      slot = (void*)meta + sizeof(metapage_t) + i * SLOTSIZE;
+      slot->heads = (unsigned long*)(slot + 1);
+      slot->used = slot->heads + BITMAPWORDS;
+      // the free slot list is threaded through the bitmaps
+      *((void**)slot->heads) = meta->freeslots;
+      meta->freeslots = slot;
+    }
+    metapages = meta;
+  }
+
+  slot = meta->freeslots;
+  meta->freeslots = *((void**)slot->heads);
+  meta->used++;
+
+  // full: off the list
+  if (meta->freeslots == NULL) {
+    metapages = meta->next;
+    if (metapages != NULL)
+      metapages->prev = NULL;
+  }
+  return slot;
+}
+
+void
+put_meta(pagemeta_t* slot)
+{
+  metapage_t* meta = BASEADDR(slot);
+
+  if (meta->freeslots == NULL) {
+    // was full: back on the list
+    meta->prev = NULL;
+    meta->next = metapages;
+    if (metapages != NULL)
+      metapages->prev = meta;
+    metapages = meta;
+  }
+  *((void**)slot->heads) = meta->freeslots;
+  meta->freeslots = slot;
+
+  if (--meta->used == 0) {
+    if (meta->prev != NULL)
+      meta->prev->next = meta->next;
+    else
+      metapages = meta->next;
+    if (meta->next != NULL)
+      meta->next->prev = meta->prev;
+    free_page(kpage_of(meta));
+  }
+}
+
+bool
+test_bit(unsigned long bitmap[], int n)
+{
+  return (bitmap[n / WORDBITS] >> (n % WORDBITS)) & 1;
+}
+
+void
+set_bit(unsigned long bitmap[], int n, bool set)
+{
+  if (set)
+    bitmap[n / WORDBITS] |= 1UL << (n % WORDBITS);
+  else
+    bitmap[n / WORDBITS] &= ~(1UL << (n % WORDBITS));
+}
+
+int
+count_range(unsigned long bitmap[], int bit, int n)
+{
+  int count = 0;
+
+  // 3*2^k buffers are not word aligned, so mask both ends
+  while (n > 0) {
+    int shift = bit % WORDBITS;
+    int len = WORDBITS - shift < n ? WORDBITS - shift : n;
+    unsigned long mask = len == WORDBITS ? ~0UL : ((1UL << len) - 1) << shift;
+
+    count += __builtin_popcountl(bitmap[bit / WORDBITS] & mask);
+    bit += len;
+    n -= len;
+  }
+  return count;
+}
+
+#endif // KMA_WBUD
@@ -49,6 +49,8 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 /************Private include**********************************************/
 #include "kpage.h"
@@ -62,15 +64,74 @@
  */
 
 /************Global Variables*********************************************/
-static kpage_stat_t kpage_stats = { 0, 0, 0, PAGESIZE };
+int kpage_size = 0;
 
+static kpage_stat_t kpage_stats = { 0, 0, 0, DEFPAGESIZE, 0, 0 };
+
+// address space reserved for the pool, ARENASIZE aligned
 static void* pool = NULL;
-static void* next_free_page = NULL;
+static int pool_arenas = 0;
+// end of the committed arenas
+static void* pool_end = NULL;
+// descriptor table, one kpage_t per pool page, committed with the arenas
+static kpage_t* page_desc = NULL;
+// first page of the pool that has never been handed out
+static void* pool_brk = NULL;
+// address-ordered free map of the pages below pool_brk (bit set = free)
+static unsigned long* free_map = NULL;
+// every word of free_map below this one is known to be all zero
+static long free_hint = 0;
+// free pages that are still resident (bit set = free and dirty)
+static unsigned long* dirty_map = NULL;
+static long num_dirty = 0;
+// free pages below pool_brk per transparent huge page, and the huge
+// pages that are entirely free and not purged since (bit set)
+static int* huge_free = NULL;
+static unsigned long* purge_map = NULL;
+static long num_purgeable = 0;
+
+static kpage_config_t kpage_config = { DEFPAGESIZE, KPAGE_DIRTY_MAX, FALSE, FALSE, 0, FALSE };
+static bool config_read = FALSE;
+
+// end of the range the helper thread pre-faults ahead of pool_brk
+static void* prefault_end = NULL;
+
+#define MAPBITS (8 * sizeof(unsigned long))
+
+// pages pre-faulted by the helper thread per step
+#define PREFAULTCHUNK 64
+
+// pool pages per transparent huge page
+#define HUGEPAGES ((int) (KPAGE_HUGESIZE / PAGESIZE))
+
+// huge pages per arena
+#define ARENAHUGE ((int) (ARENASIZE / KPAGE_HUGESIZE))
+
+// in huge mode, resident free pages beyond this many times dirty_max
+// are purged even if that splits huge pages
+#define HUGEDIRTYFACTOR 4
+
+#ifdef MADV_FREE
+#define KPAGE_MADV_LAZY MADV_FREE
+#else
+#define KPAGE_MADV_LAZY MADV_DONTNEED
+#endif
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
+void* allocPages(int);
+void freePages(void*, int);
 void initPages();
+void commitArena();
+long findRun(int);
+int markRun(unsigned long*, long, int, bool);
+void markHuge(long, int, bool);
+long purgeDirty(long);
+long purgeHuge(long);
+void readConfig() __attribute__((constructor));
+long countRun(unsigned long*, long, long);
+void startPrefault();
+void* prefaultMain(void*);
+void prefaultRange(void*, void*);
 
 /************External Declaration*****************************************/
 
@@ -78,35 +139,56 @@ void initPages();
 
 kpage_t*
 get_page()
+{
+  return get_pages(1);
+}
+
+kpage_t*
+get_pages(int n)
 {
   static int id = 0;
   kpage_t* res;
   
-  kpage_stats.num_requested++;
-  kpage_stats.num_in_use++;
+  assert(n > 0);
   
-  res = (kpage_t*) malloc(sizeof(kpage_t));
-  res->id = id++;
-  res->size = kpage_stats.page_size;
-  res->ptr = allocPage();
+  kpage_stats.num_requested += n;
+  kpage_stats.num_in_use += n;
+  
+  void* page = allocPages(n);
+  
+  assert(page != NULL);
   
-  assert(res->ptr != NULL);
+  res = kpage_of(page);
+  res->id = id++;
+  res->size = n * kpage_stats.page_size;
+  res->ptr = page;
+  res->priv = NULL;
   
   return res;	
 }
 
 void
 free_page(kpage_t* ptr)
+{
+  free_pages(ptr);
+}
+
+void
+free_pages(kpage_t* ptr)
 {
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kpage_stats.num_in_use > 0);
   
-  kpage_stats.num_freed++;
-  kpage_stats.num_in_use--;
+  int n = ptr->size / kpage_stats.page_size;
+  
+  assert(kpage_stats.num_in_use >= n);
   
-  freePage(ptr->ptr);
-  free(ptr);
+  kpage_stats.num_freed += n;
+  kpage_stats.num_in_use -= n;
+  
+  void* page = ptr->ptr;
+  ptr->ptr = NULL;
+  freePages(page, n);
 }
 
 kpage_stat_t*
@@ -114,12 +196,14 @@ page_stats()
 {
   static kpage_stat_t stats;
   
+  kpage_stats.num_retained = num_dirty;
   return memcpy(&stats, &kpage_stats, sizeof(kpage_stat_t));
 }
 
 void*
-allocPage()
+allocPages(int n)
 {
+  long first;
   void* res;
   
   if (pool == NULL)
@@ -127,58 +211,617 @@ allocPage()
       initPages();
     }
   
-  res = next_free_page;
+  // lowest-address run of n free pages; a run reaching pool_brk is
+  // completed with never-touched pages
+  first = findRun(n);
+  res = pool + first * PAGESIZE;
   
-  if (res == NULL)
+  while (res + n * PAGESIZE > pool_end)
     {
-      error("error: all pages already allocated", "");
+      commitArena();
     }
   
-  next_free_page = *((void**)next_free_page);
+  // only the part below the old pool_brk is in the maps
+  markRun(free_map, first, n, FALSE);
+  markHuge(first, n, FALSE);
+  num_dirty -= markRun(dirty_map, first, n, FALSE);
+  if (res + n * PAGESIZE > pool_brk)
+    {
+      // the pre-fault helper thread reads it
+      __atomic_store_n(&pool_brk, res + n * PAGESIZE, __ATOMIC_RELAXED);
+    }
   
-  assert(res != NULL);
+  // skip the words that just filled up
+  while (free_hint < ((pool_brk - pool) / PAGESIZE + MAPBITS - 1) / MAPBITS
+	 && free_map[free_hint] == 0)
+    {
+      free_hint++;
+    }
   
   return res;
 }
 
 void
-freePage(void* ptr)
+freePages(void* ptr, int n)
 {
   assert(ptr != NULL);
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  long first = (ptr - pool) / PAGESIZE;
+  
+  // setting the bits is all the coalescing a bitmap needs
+  markRun(free_map, first, n, TRUE);
+  markHuge(first, n, TRUE);
+  num_dirty += markRun(dirty_map, first, n, TRUE);
+  if (first / MAPBITS < free_hint)
+    {
+      free_hint = first / MAPBITS;
+    }
+  
+  // the pool, its descriptors and maps are kept when the last page
+  // comes back: tearing them down made a pool that keeps draining pay
+  // for a full rebuild every time, and the dirty budget below already
+  // bounds what an idle pool keeps resident
+  if (kpage_stats.num_in_use == 0 && kpage_config.page_size != kpage_size)
+    {
+      error("the page size cannot change once it is in use",
+	    "page_config()->page_size");
+    }
+  
+  if (num_dirty > kpage_config.dirty_max)
+    {
+      // keep at most dirty_max freed pages resident; once over budget
+      // purge down to half of it, so alloc/free bursts around the limit
+      // don't turn every free into an madvise and every alloc into a
+      // page fault. Huge pages are only released whole, which may not
+      // get there: past HUGEDIRTYFACTOR times the budget, split them.
+      if (kpage_config.huge)
+	{
+	  purgeHuge(kpage_config.dirty_max / 2);
+	}
+      if (!kpage_config.huge
+	  || num_dirty > (long) HUGEDIRTYFACTOR * kpage_config.dirty_max)
+	{
+	  purgeDirty(kpage_config.dirty_max / 2);
+	}
+    }
+}
+
+int
+page_arena(void* ptr)
+{
+  assert(ptr >= pool && ptr < pool_end);
+  
+  return (ptr - pool) / ARENASIZE;
+}
+
+kpage_t*
+kpage_of(void* ptr)
+{
+  assert(ptr >= pool && ptr < pool_end);
+  
+  return page_desc + (ptr - pool) / PAGESIZE;
+}
+
+long
+findRun(int n)
+{
+  long brk = (pool_brk - pool) / PAGESIZE;
+  long nwords = (brk + MAPBITS - 1) / MAPBITS;
+  long start = brk;
+  long len = 0;
+  long w;
+  
+  // with huge pages, reuse a resident page before one that was purged,
+  // so partly used huge pages fill up and the rest can be released whole
+  if (n == 1 && kpage_config.huge && num_dirty > 0)
+    {
+      for (w = free_hint; w < nwords; w++)
+	{
+	  if (dirty_map[w] != 0)
+	    {
+	      return w * MAPBITS + __builtin_ctzl(dirty_map[w]);
+	    }
+	}
+    }
   
-  if (kpage_stats.num_in_use == 0)
+  for (w = free_hint; w < nwords; w++)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      unsigned long word = free_map[w];
+      int bit = 0;
+      
+      if (word == 0)
+	{
+	  len = 0;
+	  continue;
+	}
+      if (n == 1)
+	{
+	  return w * MAPBITS + __builtin_ctzl(word);
+	}
+      
+      // walk the runs of set bits in this word
+      while (bit < MAPBITS)
+	{
+	  unsigned long rest = word >> bit;
+	  int ones;
+	  
+	  if (rest == 0)
+	    {
+	      // the rest of the word is past pool_brk or in use; a run that
+	      // reaches pool_brk may still be extended below
+	      if (len > 0 && start + len != brk)
+		{
+		  len = 0;
+		}
+	      break;
+	    }
+	  if ((rest & 1) == 0)
+	    {
+	      len = 0;
+	      bit += __builtin_ctzl(rest);
+	      continue;
+	    }
+	  ones = (~rest == 0) ? MAPBITS - bit : __builtin_ctzl(~rest);
+	  if (len == 0)
+	    {
+	      start = w * MAPBITS + bit;
+	    }
+	  len += ones;
+	  if (len >= n)
+	    {
+	      return start;
+	    }
+	  bit += ones;
+	}
     }
+  
+  // no room below pool_brk; extend the free run touching it, if any
+  if (len > 0 && start + len == brk)
+    {
+      return start;
+    }
+  return brk;
+}
+
+int
+markRun(unsigned long* map, long first, int n, bool set)
+{
+  long last = first + n;
+  long brk = (pool_brk - pool) / PAGESIZE;
+  int changed = 0;
+  
+  // never-touched pages beyond pool_brk are not in the maps
+  if (last > brk)
+    {
+      last = brk;
+    }
+  
+  while (first < last)
+    {
+      long w = first / MAPBITS;
+      int bit = first % MAPBITS;
+      int bits = (last - first < MAPBITS - bit) ? last - first : MAPBITS - bit;
+      unsigned long mask = (bits == MAPBITS) ? ~0UL : ((1UL << bits) - 1) << bit;
+      
+      if (set)
+	{
+	  changed += __builtin_popcountl(mask & ~map[w]);
+	  map[w] |= mask;
+	}
+      else
+	{
+	  changed += __builtin_popcountl(mask & map[w]);
+	  map[w] &= ~mask;
+	}
+      first += bits;
+    }
+  
+  return changed;
+}
+
+void
+markHuge(long first, int n, bool set)
+{
+  long last = first + n;
+  long brk = (pool_brk - pool) / PAGESIZE;
+  
+  if (last > brk)
+    {
+      last = brk;
+    }
+  // a huge page becomes purgeable when its last page is freed and stops
+  // being so when one is allocated again
+  while (first < last)
+    {
+      long h = first / HUGEPAGES;
+      long end = ((h + 1) * HUGEPAGES < last) ? (h + 1) * HUGEPAGES : last;
+      unsigned long bit = 1UL << (h % MAPBITS);
+      
+      if (set)
+	{
+	  huge_free[h] += end - first;
+	  if (huge_free[h] == HUGEPAGES)
+	    {
+	      purge_map[h / MAPBITS] |= bit;
+	      num_purgeable++;
+	    }
+	}
+      else
+	{
+	  if (purge_map[h / MAPBITS] & bit)
+	    {
+	      purge_map[h / MAPBITS] &= ~bit;
+	      num_purgeable--;
+	    }
+	  huge_free[h] -= end - first;
+	}
+      first = end;
+    }
+}
+
+long
+purgeDirty(long target)
+{
+  long w = ((pool_brk - pool) / PAGESIZE + MAPBITS - 1) / MAPBITS;
+  long purged = 0;
+  
+  // allocation is lowest-address first, so the highest dirty pages are
+  // the ones least likely to be wanted again soon
+  while (w-- > 0 && num_dirty > target)
+    {
+      while (dirty_map[w] != 0 && num_dirty > target)
+	{
+	  unsigned long word = dirty_map[w];
+	  int hi = MAPBITS - 1 - __builtin_clzl(word);
+	  unsigned long holes = ~word & ((hi == MAPBITS - 1) ? ~0UL : (1UL << (hi + 1)) - 1);
+	  int lo = (holes == 0) ? 0 : MAPBITS - __builtin_clzl(holes);
+	  int len = hi - lo + 1;
+	  
+	  madvise(pool + (w * MAPBITS + lo) * PAGESIZE, (long) len * PAGESIZE,
+		  kpage_config.lazy_purge ? KPAGE_MADV_LAZY : MADV_DONTNEED);
+	  
+	  dirty_map[w] &= ~(((len == MAPBITS) ? ~0UL : (1UL << len) - 1) << lo);
+	  num_dirty -= len;
+	  purged += len;
+	}
+    }
+  
+  kpage_stats.num_purged += purged;
+  return purged;
+}
+
+long
+purgeHuge(long target)
+{
+  long w = ((pool_brk - pool) / KPAGE_HUGESIZE + MAPBITS - 1) / MAPBITS;
+  long purged = 0;
+  
+  // only release huge pages that are entirely free, so the kernel never
+  // has to split a huge page that still backs live data. markHuge()
+  // keeps those in purge_map, highest addresses first as in
+  // purgeDirty(); with none there is nothing to look at.
+  while (num_purgeable > 0 && w-- > 0 && num_dirty > target)
+    {
+      while (purge_map[w] != 0 && num_dirty > target)
+	{
+	  int bit = MAPBITS - 1 - __builtin_clzl(purge_map[w]);
+	  long h = w * MAPBITS + bit;
+	  long first = h * HUGEPAGES;
+	  long dirty = countRun(dirty_map, first, HUGEPAGES);
+	  
+	  purge_map[w] &= ~(1UL << bit);
+	  num_purgeable--;
+	  // purgeDirty() may have released its pages already
+	  if (dirty == 0)
+	    {
+	      continue;
+	    }
+	  
+	  madvise(pool + h * KPAGE_HUGESIZE, KPAGE_HUGESIZE,
+		  kpage_config.lazy_purge ? KPAGE_MADV_LAZY : MADV_DONTNEED);
+	  markRun(dirty_map, first, HUGEPAGES, FALSE);
+	  num_dirty -= dirty;
+	  purged += dirty;
+	}
+    }
+  
+  kpage_stats.num_purged += purged;
+  return purged;
+}
+
+long
+countRun(unsigned long* map, long first, long n)
+{
+  long last = first + n;
+  long count = 0;
+  
+  while (first < last)
+    {
+      long w = first / MAPBITS;
+      int bit = first % MAPBITS;
+      int bits = (last - first < MAPBITS - bit) ? last - first : MAPBITS - bit;
+      unsigned long mask = (bits == MAPBITS) ? ~0UL : ((1UL << bits) - 1) << bit;
+      
+      count += __builtin_popcountl(map[w] & mask);
+      first += bits;
+    }
+  
+  return count;
+}
+
+int
+trim_pages(int keep)
+{
+  long purged = 0;
+  
+  if (pool == NULL || num_dirty <= keep)
+    {
+      return 0;
+    }
+  // release whole huge pages first; an explicit trim may split the rest
+  if (kpage_config.huge)
+    {
+      purged = purgeHuge(keep);
+    }
+  return purged + purgeDirty(keep);
+}
+
+int
+kma_trim()
+{
+  return trim_pages(0);
+}
+
+void
+page_init()
+{
+  if (pool == NULL)
+    {
+      initPages();
+      // only here: when get_pages() sets the pool up on first use, this
+      // would land on the allocation path it is meant to keep page
+      // faults off
+      if (kpage_config.prefault > 0)
+	{
+	  startPrefault();
+	}
+    }
+}
+
+kpage_config_t*
+page_config()
+{
+  readConfig();
+  return &kpage_config;
+}
+
+void
+readConfig()
+{
+  char* env;
+  
+  if (config_read)
+    {
+      return;
+    }
+  config_read = TRUE;
+  
+  if ((env = getenv("KPAGE_SIZE")) != NULL)
+    {
+      kpage_config.page_size = atoi(env);
+    }
+  if ((env = getenv("KPAGE_DIRTY_MAX")) != NULL)
+    {
+      kpage_config.dirty_max = atoi(env);
+    }
+  if ((env = getenv("KPAGE_LAZY_PURGE")) != NULL)
+    {
+      kpage_config.lazy_purge = atoi(env);
+    }
+  if ((env = getenv("KPAGE_HUGE")) != NULL)
+    {
+      kpage_config.huge = atoi(env);
+    }
+  if ((env = getenv("KPAGE_PREFAULT")) != NULL)
+    {
+      kpage_config.prefault = atoi(env);
+    }
+  if ((env = getenv("KPAGE_PREFAULT_ASYNC")) != NULL)
+    {
+      kpage_config.prefault_async = atoi(env);
+    }
+}
+
+int
+kpage_fix_size()
+{
+  if (kpage_size != 0)
+    {
+      return kpage_size;
+    }
+  readConfig();
+  if (kpage_config.page_size < MINPAGESIZE || kpage_config.page_size > MAXPAGESIZE
+      || (kpage_config.page_size & (kpage_config.page_size - 1)) != 0)
+    error("unsupported page size", getenv("KPAGE_SIZE") ? getenv("KPAGE_SIZE") : "");
+  kpage_size = kpage_config.page_size;
+  kpage_stats.page_size = kpage_size;
+  return kpage_size;
 }
 
 void
 initPages()
 {
-  int i;
+  void* addr;
+  long slop;
   
-  assert(next_free_page == NULL);
   assert(pool == NULL);
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  readConfig();
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  // the allocators' tables were sized for the page size already in use
+  if (kpage_size != 0 && kpage_config.page_size != kpage_size)
+    error("the page size cannot change once it is in use",
+	  "page_config()->page_size");
+  kpage_fix_size();
+  
+  // reserve address space only; arenas get committed as the pool grows.
+  // Back off if the address space is limited (e.g. ulimit -v).
+  for (pool_arenas = MAXARENAS; pool_arenas > 0; pool_arenas /= 2)
+    {
+      addr = mmap(NULL, (pool_arenas + 1) * ARENASIZE, PROT_NONE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (addr != MAP_FAILED)
+	break;
+    }
+  if (pool_arenas == 0)
+    error("Error using mmap to reserve the page pool", "");
+  
+  // trim the reservation so the arenas are ARENASIZE aligned
+  slop = (-(long) addr) & (ARENASIZE - 1);
+  pool = addr + slop;
+  if (slop > 0)
+    munmap(addr, slop);
+  munmap(pool + pool_arenas * ARENASIZE, ARENASIZE - slop);
+  
+  // the descriptor table is reserved alongside and committed per arena
+  page_desc = mmap(NULL, pool_arenas * ARENAPAGES * sizeof(kpage_t),
+		   PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		   -1, 0);
+  if (page_desc == MAP_FAILED)
+    error("Error using mmap to reserve the page descriptors", "");
+  
+  // the free map is small enough (one bit per page) to just leave to
+  // demand paging
+  free_map = mmap(NULL, pool_arenas * ARENAPAGES / 8,
+		  PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (free_map == MAP_FAILED)
+    error("Error using mmap to reserve the page free map", "");
+  dirty_map = mmap(NULL, pool_arenas * ARENAPAGES / 8,
+		   PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (dirty_map == MAP_FAILED)
+    error("Error using mmap to reserve the page dirty map", "");
+  huge_free = mmap(NULL, pool_arenas * ARENAHUGE * sizeof(int),
+		   PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  purge_map = mmap(NULL, pool_arenas * ARENAHUGE / 8,
+		   PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (huge_free == MAP_FAILED || purge_map == MAP_FAILED)
+    error("Error using mmap to reserve the huge page maps", "");
+  
+  // pages are handed out lazily from pool_brk, so nothing in the pool is
+  // touched here and the kernel only backs the pages actually in use
+  pool_end = pool;
+  pool_brk = pool;
+  free_hint = 0;
+  num_dirty = 0;
+  num_purgeable = 0;
+}
+
+void
+startPrefault()
+{
+  pthread_t thread;
+  long n = kpage_config.prefault;
+  
+  if (n > (long) pool_arenas * ARENAPAGES)
+    {
+      n = (long) pool_arenas * ARENAPAGES;
+    }
+  
+  // commit up front; the helper thread must never race commitArena()
+  while (pool_end < pool + n * PAGESIZE)
+    {
+      commitArena();
+    }
+  prefault_end = pool + n * PAGESIZE;
+  
+  // the pool is never unmapped, so the thread is left to finish on its
+  // own
+  if (kpage_config.prefault_async
+      && pthread_create(&thread, NULL, prefaultMain, NULL) == 0)
+    {
+      pthread_detach(thread);
+      return;
+    }
+  
+  prefaultRange(pool, prefault_end);
+}
+
+void*
+prefaultMain(void* arg)
+{
+  void* addr;
+  
+  for (addr = pool; addr < prefault_end; addr += PREFAULTCHUNK * PAGESIZE)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      void* end = addr + PREFAULTCHUNK * PAGESIZE;
+      void* start = addr;
+      void* brk = __atomic_load_n(&pool_brk, __ATOMIC_RELAXED);
       
-      *((void**) ptr) = next;
+      if (end > prefault_end)
+	{
+	  end = prefault_end;
+	}
+      // the allocator already caught up with this chunk, or with part of
+      // it: pages below pool_brk may be free and purged, and faulting
+      // them back in would leave them resident without being counted
+      if (end <= brk)
+	{
+	  continue;
+	}
+      if (start < brk)
+	{
+	  start = brk;
+	}
+      prefaultRange(start, end);
+    }
+  
+  return NULL;
+}
+
+void
+prefaultRange(void* start, void* end)
+{
+  void* addr;
+  
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(start, end - start, MADV_POPULATE_WRITE) == 0)
+    {
+      return;
+    }
+#endif
+  // older kernels: touch each OS page without changing its contents, as
+  // the helper thread may reach pages that are already handed out
+  for (addr = start; addr < end; addr += MINPAGESIZE)
+    {
+      __atomic_fetch_or((char*) addr, 0, __ATOMIC_RELAXED);
+    }
+}
+
+void
+commitArena()
+{
+  if (pool_end == pool + pool_arenas * ARENASIZE)
+    {
+      error("error: all pages already allocated", "");
+    }
+  
+  int arena = (pool_end - pool) / ARENASIZE;
+  
+  if (mprotect(pool_end, ARENASIZE, PROT_READ | PROT_WRITE)
+      || mprotect(page_desc + arena * ARENAPAGES, ARENAPAGES * sizeof(kpage_t),
+		  PROT_READ | PROT_WRITE))
+    error("Error using mprotect to commit an arena", "");
+  
+  // arenas are ARENASIZE aligned, hence huge page aligned too; if the
+  // kernel has no THP support just carry on with normal pages
+  if (kpage_config.huge && madvise(pool_end, ARENASIZE, MADV_HUGEPAGE))
+    {
+      kpage_config.huge = FALSE;
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  pool_end += ARENASIZE;
 }
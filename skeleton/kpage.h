@@ -66,9 +66,27 @@
 #define EXTERN extern
 #endif
 
-#define PAGESIZE 8192
+// supported page sizes; the one in use is taken from the configuration
+// (page_config()->page_size, KPAGE_SIZE) the first time anything needs
+// it, and never changes after that
+#define MINPAGESIZE 4096
+#define MAXPAGESIZE 65536
+#define DEFPAGESIZE 8192
 
-#define MAXPAGES 4096
+#define PAGESIZE (kpage_size != 0 ? kpage_size : kpage_fix_size())
+
+// the pool grows in arenas of ARENASIZE bytes, committed on demand
+#define ARENASIZE (32L << 20)
+#define ARENAPAGES ((int) (ARENASIZE / PAGESIZE))
+
+// upper bound on the address space reserved for arenas (256 GB)
+#define MAXARENAS 8192
+
+// transparent huge page size the pool packs pages into
+#define KPAGE_HUGESIZE (2L << 20)
+
+// default number of freed pages kept resident before purging
+#define KPAGE_DIRTY_MAX 512
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -80,11 +98,25 @@
  ***********************************************************************/
 #define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
 
+/***********************************************************************
+ *  Title: Arena Page Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the index of a pointer's page within its arena
+ *             (arenas are ARENASIZE aligned)
+ *    Input: pointer into the page pool
+ *    Output: the page index, 0 .. ARENAPAGES-1
+ ***********************************************************************/
+#define ARENAPAGE(x) ((int)((((long) (x)) & (ARENASIZE-1)) / PAGESIZE))
+
+// page descriptor; one per pool page, kept in a table indexed by page
+// number so no descriptor is ever allocated or freed
 typedef struct
 {
   int id;
-  void* ptr;
   int size;
+  void* ptr;
+  void* priv;  // the allocator's own (NULL from get_pages()), e.g. for
+               // metadata kept outside the page
 } kpage_t;
 
 typedef struct
@@ -93,10 +125,37 @@ typedef struct
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_retained; // free pages still resident
+  int num_purged;   // free pages returned to the OS so far
 } kpage_stat_t;
 
+// page pool tunables. dirty_max and lazy_purge take effect at the next
+// free, huge for the arenas committed from then on, and prefault only
+// in page_init(). The pool is set up once and kept when all pages have
+// been freed, so the page size, which allocators size their tables by,
+// is fixed the first time PAGESIZE is used or a page is allocated;
+// finding it changed when the pool is set up or drains is a fatal
+// error. Defaults can be overridden with the KPAGE_* environment
+// variables.
+typedef struct
+{
+  int page_size;   // one of 4096, 8192, 16384, 65536 (KPAGE_SIZE)
+  int dirty_max;   // freed pages kept resident (KPAGE_DIRTY_MAX); only a
+                   // target with huge, which purges whole free huge pages
+                   // and splits them only past 4 times this many
+  int lazy_purge;  // purge with MADV_FREE, not MADV_DONTNEED (KPAGE_LAZY_PURGE)
+  int huge;        // back arenas with transparent huge pages (KPAGE_HUGE);
+                   // cleared again if the kernel lacks THP support
+  int prefault;    // pages page_init() pre-faults (KPAGE_PREFAULT)
+  int prefault_async; // pre-fault from a helper thread racing ahead of
+                   // the allocator instead of up front (KPAGE_PREFAULT_ASYNC)
+} kpage_config_t;
+
 /************Global Variables*********************************************/
 
+// the page size in use; 0 until it is fixed
+EXTERN int kpage_size;
+
 /************Function Prototypes******************************************/
 
 /***********************************************************************
@@ -117,6 +176,26 @@ EXTERN kpage_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kpage_t*);
 
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a run of n physically contiguous, page aligned
+ *             memory pages (the lowest-addressed run that fits)
+ *    Input: the number of pages
+ *    Output: the descriptor of the run; size is n * PAGESIZE
+ ***********************************************************************/
+EXTERN kpage_t* get_pages(int n);
+
+/***********************************************************************
+ *  Title: Releases contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run of pages from get_pages() (or a single
+ *             page from get_page()); adjacent free runs coalesce
+ *    Input: the pointer to the memory page structure
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kpage_t*);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
@@ -126,6 +205,70 @@ EXTERN void free_page(kpage_t*);
  ***********************************************************************/
 EXTERN kpage_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Initializes the page pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Sets up the page pool ahead of the first allocation, so
+ *             startup work happens at boot time; get_pages() otherwise
+ *             does this on first use, but without pre-faulting. The
+ *             pool then stays set up, also once all pages are freed
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_init();
+
+/***********************************************************************
+ *  Title: Memory page configuration
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the page pool tunables for inspection or change
+ *    Input: none
+ *    Output: the live page pool configuration
+ ***********************************************************************/
+EXTERN kpage_config_t* page_config();
+
+/***********************************************************************
+ *  Title: Fixes the page size
+ * ---------------------------------------------------------------------
+ *    Purpose: Takes the page size from the configuration for good;
+ *             PAGESIZE calls this on its first use
+ *    Input: none
+ *    Output: the page size
+ ***********************************************************************/
+EXTERN int kpage_fix_size();
+
+/***********************************************************************
+ *  Title: Returns idle pages to the OS
+ * ---------------------------------------------------------------------
+ *    Purpose: Purges free but still resident pages with madvise,
+ *             highest addresses first, until at most keep remain
+ *    Input: the number of resident free pages to keep
+ *    Output: the number of pages purged
+ ***********************************************************************/
+EXTERN int trim_pages(int keep);
+
+/***********************************************************************
+ *  Title: Arena lookup
+ * ---------------------------------------------------------------------
+ *    Purpose: Find the arena a pointer belongs to in O(1), so that
+ *             allocators can keep page-indexed metadata per arena
+ *             (arena, ARENAPAGE(ptr)) however large the pool grows
+ *    Input: pointer into an allocated page
+ *    Output: the arena index, 0 .. MAXARENAS-1
+ ***********************************************************************/
+EXTERN int page_arena(void*);
+
+/***********************************************************************
+ *  Title: Page descriptor lookup
+ * ---------------------------------------------------------------------
+ *    Purpose: Find the descriptor of the page containing a pointer in
+ *             O(1), so allocators need not store a back-pointer to it.
+ *             For a run from get_pages() only the descriptor of the
+ *             first page describes the run.
+ *    Input: pointer into an allocated page
+ *    Output: the page descriptor
+ ***********************************************************************/
+EXTERN kpage_t* kpage_of(void*);
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
@@ -0,0 +1,192 @@
+/***************************************************************************
+ *  Title: Page Pool Tests
+ * -------------------------------------------------------------------------
+ *    Purpose: Checks how the page pool places page runs
+ *    File: kpage_test.c
+ ***************************************************************************/
+#define __KMA_TEST_IMPL__
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+/************Global Variables*********************************************/
+
+static int failures = 0;
+
+/************Function Prototypes******************************************/
+
+// a freed run below the pool's break is reused before the pool grows
+void test_reuse_hole();
+
+// a free run reaching the pool's break is extended rather than skipped
+void test_extend_run_at_brk();
+
+// the pool keeps its pages and maps when the last page is freed
+void test_keep_pool_when_drained();
+
+// in huge mode free pages stay near the dirty budget, also when no huge
+// page is entirely free
+void test_huge_dirty_budget();
+
+void check(bool, char*, int);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  page_init();
+
+  test_reuse_hole();
+  test_extend_run_at_brk();
+  test_keep_pool_when_drained();
+  test_huge_dirty_budget();
+
+  if (failures > 0)
+    {
+      printf("kpage_test: %d check(s) failed\n", failures);
+      return 1;
+    }
+  printf("kpage_test: PASS\n");
+  return 0;
+}
+
+void
+test_reuse_hole()
+{
+  kpage_t* p[3];
+  void* hole;
+  int i;
+
+  for (i = 0; i < 3; i++)
+    {
+      p[i] = get_page();
+    }
+  hole = p[1]->ptr;
+  free_page(p[1]);
+
+  p[1] = get_page();
+  CHECK(p[1]->ptr == hole);
+
+  for (i = 0; i < 3; i++)
+    {
+      free_page(p[i]);
+    }
+  CHECK(page_stats()->num_in_use == 0);
+}
+
+void
+test_extend_run_at_brk()
+{
+  kpage_t* p[3];
+  kpage_t* run;
+  void* start;
+  int i;
+
+  for (i = 0; i < 3; i++)
+    {
+      p[i] = get_page();
+    }
+  CHECK(p[1]->ptr == p[0]->ptr + PAGESIZE);
+  CHECK(p[2]->ptr == p[1]->ptr + PAGESIZE);
+
+  // pages 1 and 2 are free and end at the break: 4 pages fit from page
+  // 1 by growing the pool by two, not from page 3 leaving a hole
+  start = p[1]->ptr;
+  free_page(p[1]);
+  free_page(p[2]);
+  run = get_pages(4);
+  CHECK(run->ptr == start);
+
+  free_pages(run);
+  free_page(p[0]);
+  CHECK(page_stats()->num_in_use == 0);
+}
+
+void
+test_keep_pool_when_drained()
+{
+  kpage_t* p;
+  void* addr;
+  
+  p = get_page();
+  addr = p->ptr;
+  free_page(p);
+  CHECK(page_stats()->num_in_use == 0);
+  
+  // descriptors outlive the drain and the lowest page comes back
+  CHECK(kpage_of(addr) == p);
+  p = get_page();
+  CHECK(p->ptr == addr);
+  free_page(p);
+}
+
+void
+test_huge_dirty_budget()
+{
+  kpage_config_t saved = *page_config();
+  int hugepages = KPAGE_HUGESIZE / PAGESIZE;
+  int n = 4 * hugepages;
+  kpage_t** p = malloc(n * sizeof(kpage_t*));
+  int i;
+  
+  page_config()->huge = TRUE;
+  page_config()->dirty_max = hugepages / 4;
+  trim_pages(0);
+  
+  for (i = 0; i < n; i++)
+    {
+      p[i] = get_page();
+    }
+  // every other page: no huge page is entirely free
+  for (i = 0; i < n; i += 2)
+    {
+      free_page(p[i]);
+    }
+  CHECK(page_stats()->num_retained < n / 2);
+  
+  // now they all are, and are released whole
+  for (i = 1; i < n; i += 2)
+    {
+      free_page(p[i]);
+    }
+  CHECK(page_stats()->num_retained <= page_config()->dirty_max);
+  CHECK(page_stats()->num_in_use == 0);
+  
+  free(p);
+  page_config()->huge = saved.huge;
+  page_config()->dirty_max = saved.dirty_max;
+}
+
+void
+check(bool ok, char* cond, int line)
+{
+  if (!ok)
+    {
+      printf("kpage_test.c:%d: check failed: %s\n", line, cond);
+      failures++;
+    }
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
@@ -80,6 +80,7 @@
 	void deallocate();
 	void fill(char*, int);
 	void check(char*, char*, int);
+	void error(char*, char*);
 	
   /************External Declaration*****************************************/
 
@@ -159,13 +160,11 @@ void allocate()
 
 	new->ptr = kma_malloc(new->size);
 
-	assert(((new->ptr != NULL) && (new->size <= MAX_SIZE))
-		   || ((new->ptr == NULL) && (new->size > MAX_SIZE)));
-	
+	// requests larger than a page are served from contiguous page runs,
+	// so every request is alloc'able
 	if (new->ptr == NULL)
 	{
-		free(new);
-		return;
+		error("got NULL from kma_malloc for alloc'able request", "");
 	}	
 	
 	new->value = malloc(new->size);
@@ -244,3 +243,10 @@ void check(char* lhs, char* rhs, int size)
 		}
 	}
 }
+
+void error(char* message, char* arg)
+{
+	fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+	printf("Test: FAILED\n");
+	exit(1);
+}
@@ -54,6 +54,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 /************Private include**********************************************/
 #include "kpage.h"
@@ -66,6 +72,10 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// number of leading trace operations whose latency is reported; those
+// are the ones paying for page faults unless the pool is pre-faulted
+#define FIRST_OPS 1000
+
 enum REQ_STATE
   {
     FREE,
@@ -93,6 +103,9 @@ void usage();
 void error(char*, char*);
 void pass();
 void fail();
+double elapsedUs(struct timespec*);
+int openTlbCounter();
+long long readTlbCounter(int);
 
 /************External Declaration*****************************************/
 
@@ -121,6 +134,7 @@ main(int argc, char* argv[])
 #endif
 
   int n_req = 0, n_alloc=0, n_dealloc=0;
+  int maxRetained = 0;
   kpage_stat_t* stat;
 
 #ifdef COMPETITION
@@ -160,6 +174,18 @@ main(int argc, char* argv[])
   char command[16];
   int req_id, req_size, index = 1;
 
+  // count dTLB misses over the trace (set KPAGE_HUGE=1 to compare
+  // against a huge page backed pool)
+  int tlbCounter = openTlbCounter();
+
+  // set the page pool up (and pre-fault it, if so configured) before
+  // timing, as a service would at boot
+  page_init();
+
+  struct timespec firstStart;
+  double firstOpsUs = -1;
+  clock_gettime(CLOCK_MONOTONIC, &firstStart);
+
   // Parse the lines in the file, and call allocate or
   // deallocate accordingly.
   while (fscanf(f_test, "%10s", command) == 1)
@@ -192,6 +218,8 @@ main(int argc, char* argv[])
 
       stat = page_stats();
       int totalBytes = stat->num_in_use * stat->page_size;
+      if (stat->num_retained > maxRetained)
+	maxRetained = stat->num_retained;
 
       
 #ifdef COMPETITION
@@ -208,6 +236,9 @@ main(int argc, char* argv[])
 #ifndef COMPETITION
       fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
 #endif
+
+      if (index == FIRST_OPS)
+	firstOpsUs = elapsedUs(&firstStart);
       
       index += 1;
     }
@@ -216,11 +247,24 @@ main(int argc, char* argv[])
   fclose(allocTrace);
 #endif
   
+  if (firstOpsUs >= 0)
+    printf("First %d operations (%d pages pre-faulted%s): %.0f us\n",
+	   FIRST_OPS, page_config()->prefault,
+	   page_config()->prefault_async ? " in background" : "", firstOpsUs);
+  
+  long long tlbMisses = readTlbCounter(tlbCounter);
+  if (tlbMisses >= 0)
+    printf("dTLB load misses (%s pages): %lld\n",
+	   page_config()->huge ? "huge" : "normal", tlbMisses);
+  else
+    printf("dTLB load misses: unavailable\n");
   
   stat = page_stats();
   
   printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
 	 stat->num_requested, stat->num_freed, stat->num_in_use);	
+  printf("Page Purged/Max Retained:    %5d/%5d\n",
+	 stat->num_purged, maxRetained);
   
   if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
     {
@@ -276,16 +320,11 @@ allocate(mem_t* requests, int req_id, int req_size)
   new->size = req_size;
   new->ptr = kma_malloc(new->size);
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
-    {
-      error("got NULL from kma_malloc for alloc'able request", "");
-    }
-  
+  // requests larger than a page are served from contiguous page runs,
+  // so every request is alloc'able
   if (new->ptr == NULL)
     {
-      return;
+      error("got NULL from kma_malloc for alloc'able request", "");
     }
 
   currentAllocBytes += req_size;
@@ -361,3 +400,51 @@ check(char* lhs, char* rhs, int size)
 	}
     }
 }
+
+int
+openTlbCounter()
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+  
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  
+  // -1 if the counter is missing or perf events are not permitted
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+long long
+readTlbCounter(int fd)
+{
+  long long count = -1;
+  
+#ifdef __linux__
+  if (fd >= 0)
+    {
+      if (read(fd, &count, sizeof(count)) != sizeof(count))
+	count = -1;
+      close(fd);
+    }
+#endif
+  return count;
+}
+
+double
+elapsedUs(struct timespec* start)
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e6
+    + (now.tv_nsec - start->tv_nsec) / 1e3;
+}